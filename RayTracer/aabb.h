@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+#include "vec.h"
+
+// axis aligned bounding box
+struct aabb_t
+{
+	vec3_t min, max;
+
+	static aabb_t empty() { return { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } }; }
+
+	aabb_t& grow(const vec3_t& p)
+	{
+		min = { minf(min.x, p.x), minf(min.y, p.y), minf(min.z, p.z) };
+		max = { maxf(max.x, p.x), maxf(max.y, p.y), maxf(max.z, p.z) };
+		return *this;
+	}
+
+	aabb_t& grow(const aabb_t& box)
+	{
+		min = { minf(min.x, box.min.x), minf(min.y, box.min.y), minf(min.z, box.min.z) };
+		max = { maxf(max.x, box.max.x), maxf(max.y, box.max.y), maxf(max.z, box.max.z) };
+		return *this;
+	}
+
+	// overlap of both boxes, empty when they do not overlap
+	aabb_t clip(const aabb_t& box) const
+	{
+		return { { maxf(min.x, box.min.x), maxf(min.y, box.min.y), maxf(min.z, box.min.z) },
+			{ minf(max.x, box.max.x), minf(max.y, box.max.y), minf(max.z, box.max.z) } };
+	}
+
+	bool is_empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+	vec3_t center() const { return (min + max) * 0.5f; }
+	vec3_t extent() const { return max - min; }
+
+	float area() const
+	{
+		if (is_empty()) return 0.0f;
+		vec3_t e = extent();
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
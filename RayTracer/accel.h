@@ -0,0 +1,268 @@
+#pragma once
+
+#include "ray_tracer.h"
+#include "prims.h"
+#include "sphere_batch.h"
+#include "simd.h"
+
+#include <vector>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+// std::allocator does not honor alignments above 16 bytes before C++17, nodes need cache line alignment
+template<typename T, size_t ALIGNMENT>
+struct aligned_allocator_t
+{
+	typedef T value_type;
+	template<typename U> struct rebind { typedef aligned_allocator_t<U, ALIGNMENT> other; };
+
+	aligned_allocator_t() {}
+	template<typename U> aligned_allocator_t(const aligned_allocator_t<U, ALIGNMENT>&) {}
+
+	T* allocate(size_t count)
+	{
+#ifdef _MSC_VER
+		void* memory = _aligned_malloc(count * sizeof(T), ALIGNMENT);
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, ALIGNMENT, count * sizeof(T)) != 0) memory = nullptr;
+#endif
+		if (memory == nullptr)
+		{
+			printf("Failed to allocate %zu bytes\n", count * sizeof(T));
+			abort(); // the project is built without exception handling
+		}
+		return (T*)memory;
+	}
+
+	void deallocate(T* memory, size_t)
+	{
+#ifdef _MSC_VER
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+
+	bool operator==(const aligned_allocator_t&) const { return true; }
+	bool operator!=(const aligned_allocator_t&) const { return false; }
+};
+
+static const uint32_t PRIM_NONE = 0xFFFFFFFF;
+
+// flat view of the scene objects that the acceleration structures index into; the geometry intersection needs is
+// copied out of the objects into arrays per type, grouped by primitive index, so testing a primitive is a branch on
+// its index instead of a virtual call, and traversal does not pull materials and textures into the cache.
+// The objects stay the source of truth, and are still used to shade hits and to intersect other types
+struct prim_set_t
+{
+	std::vector<const object_t*> objects;
+	std::vector<aabb_t> bounds;
+	uint32_t sphere_end = 0, plane_end = 0; // spheres come first, then planes, then everything else
+	sphere_array_t spheres;
+	plane_array_t planes;
+	sphere_batch_t sphere_batch; // up to the best level the CPU supports
+
+	void build(const std::vector<std::unique_ptr<object_t>>& source)
+	{
+		// one pass per type keeps the order of the objects within each type
+		objects.clear();
+		for (const auto& object : source)
+			if (dynamic_cast<const sphere_t*>(object.get()) != nullptr) objects.push_back(object.get());
+		sphere_end = size();
+		for (const auto& object : source)
+			if (dynamic_cast<const plane_t*>(object.get()) != nullptr) objects.push_back(object.get());
+		plane_end = size();
+		for (const auto& object : source)
+			if (dynamic_cast<const sphere_t*>(object.get()) == nullptr && dynamic_cast<const plane_t*>(object.get()) == nullptr)
+				objects.push_back(object.get());
+		update();
+	}
+
+	// copies bounds and geometry from the objects again after they moved or changed
+	void update()
+	{
+		bounds.resize(objects.size());
+		for (uint32_t i = 0; i < size(); i++)
+			bounds[i] = objects[i]->get_bounds();
+		spheres.resize(sphere_end);
+		for (uint32_t i = 0; i < sphere_end; i++)
+			spheres.set(i, *static_cast<const sphere_t*>(objects[i]));
+		planes.resize(plane_end - sphere_end);
+		for (uint32_t i = sphere_end; i < plane_end; i++)
+			planes.set(i - sphere_end, *static_cast<const plane_t*>(objects[i]));
+	}
+
+	uint32_t size() const { return (uint32_t)objects.size(); }
+
+	float intersect(uint32_t prim, const ray_t& ray) const
+	{
+		if (prim < sphere_end) return sphere_intersect(spheres.center(prim), spheres.radius_sq[prim], ray);
+		if (prim < plane_end) return plane_intersect(planes.frames[prim - sphere_end], ray);
+		return objects[prim]->intersect(ray);
+	}
+
+	bool occluded(uint32_t prim, const ray_t& ray, float tmax) const
+	{
+		if (prim < sphere_end) return sphere_occluded(spheres.center(prim), spheres.radius_sq[prim], ray, tmax);
+		if (prim < plane_end) return plane_occluded(planes.frames[prim - sphere_end], ray, tmax);
+		return objects[prim]->occluded(ray, tmax);
+	}
+
+	// updates distance and hit when one of the listed primitives is closer
+	void intersect(const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit) const
+	{
+		// short lists are not worth a batch, longer ones pass their spheres to the batched kernel
+		static const uint32_t BATCH_MIN = 4, BATCH_SIZE = 64;
+		uint32_t batch[BATCH_SIZE];
+		uint32_t batch_count = 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (count >= BATCH_MIN && ids[i] < sphere_end)
+			{
+				batch[batch_count++] = ids[i];
+				if (batch_count == BATCH_SIZE)
+				{
+					sphere_batch.intersect(spheres, batch, batch_count, ray, distance, hit);
+					batch_count = 0;
+				}
+				continue;
+			}
+
+			float object_distance = intersect(ids[i], ray);
+			if (object_distance < *distance)
+			{
+				*distance = object_distance;
+				*hit = ids[i];
+			}
+		}
+		if (batch_count > 0) sphere_batch.intersect(spheres, batch, batch_count, ray, distance, hit);
+	}
+
+	// checks if any of the listed primitives, except the ignored one, blocks the ray before tmax;
+	// the blocking primitive is stored in occluder when requested
+	bool occluded(const uint32_t* ids, uint32_t count, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (objects[ids[i]] != ignore && occluded(ids[i], ray, tmax))
+			{
+				if (occluder != nullptr) *occluder = ids[i];
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// ray with precomputed reciprocal direction, used for slab tests against bounding boxes
+struct slab_ray_t
+{
+	vec3_t origin, inv_dir;
+
+	explicit slab_ray_t(const ray_t& ray) : origin(ray.origin),
+		inv_dir{ 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z } {}
+
+	// returns the distance at which the ray enters the box or INFINITY if the box is missed before tmax
+	float hit(const aabb_t& box, float tmax) const
+	{
+		float tx0 = (box.min.x - origin.x) * inv_dir.x, tx1 = (box.max.x - origin.x) * inv_dir.x;
+		float ty0 = (box.min.y - origin.y) * inv_dir.y, ty1 = (box.max.y - origin.y) * inv_dir.y;
+		float tz0 = (box.min.z - origin.z) * inv_dir.z, tz1 = (box.max.z - origin.z) * inv_dir.z;
+		float tnear = maxf(maxf(minf(tx0, tx1), minf(ty0, ty1)), maxf(minf(tz0, tz1), 0.0f));
+		float tfar = minf(minf(maxf(tx0, tx1), maxf(ty0, ty1)), minf(maxf(tz0, tz1), tmax));
+		return tnear <= tfar ? tnear : INFINITY;
+	}
+};
+
+// rays from one origin traced together, like the camera rays of a block of pixels; each lane gets the hit it would
+// get alone, the packet only shares the node tests. Lanes are stored per component so boxes are tested 4 at a time
+struct ray_packet_t
+{
+	static const uint32_t MAX_SIZE = 256; // 16x16 pixels
+
+	vec3_t origin;
+	uint32_t size = 0; // rays in use, lanes up to the next multiple of 4 are padding that hits nothing
+	alignas(16) float dir_x[MAX_SIZE], dir_y[MAX_SIZE], dir_z[MAX_SIZE];
+	alignas(16) float inv_x[MAX_SIZE], inv_y[MAX_SIZE], inv_z[MAX_SIZE];
+	alignas(16) float distance[MAX_SIZE]; // closest hit so far, INFINITY when nothing is hit
+	uint32_t prim[MAX_SIZE];
+
+	void add(const vec3_t& direction)
+	{
+		dir_x[size] = direction.x; dir_y[size] = direction.y; dir_z[size] = direction.z;
+		inv_x[size] = 1.0f / direction.x; inv_y[size] = 1.0f / direction.y; inv_z[size] = 1.0f / direction.z;
+		distance[size] = INFINITY;
+		prim[size] = PRIM_NONE;
+		size++;
+	}
+
+	// pads the last group of 4 lanes with rays that cannot hit anything
+	void finish()
+	{
+		for (uint32_t lane = size; lane % 4 != 0; lane++)
+		{
+			dir_x[lane] = dir_x[0]; dir_y[lane] = dir_y[0]; dir_z[lane] = dir_z[0];
+			inv_x[lane] = inv_x[0]; inv_y[lane] = inv_y[0]; inv_z[lane] = inv_z[0];
+			distance[lane] = -INFINITY;
+		}
+	}
+
+	ray_t ray(uint32_t lane) const { return { origin, { dir_x[lane], dir_y[lane], dir_z[lane] } }; }
+	uint32_t groups() const { return (size + 3) / 4; }
+
+	// the packet is traversed front to back in a single order, which only suits rays of the same direction octant
+	bool coherent() const
+	{
+		for (uint32_t lane = 1; lane < size; lane++)
+			if ((dir_x[lane] < 0.0f) != (dir_x[0] < 0.0f) || (dir_y[lane] < 0.0f) != (dir_y[0] < 0.0f) || (dir_z[lane] < 0.0f) != (dir_z[0] < 0.0f))
+				return false;
+		return true;
+	}
+
+	// lanes of the group whose rays enter the box before their closest hit, same test as slab_ray_t::hit
+	uint32_t hit_mask(const aabb_t& box, uint32_t group) const
+	{
+		typedef simd_float_t<4> float4;
+		uint32_t lane = group * 4;
+		float4 tx0 = (float4::set1(box.min.x) - float4::set1(origin.x)) * float4::load(&inv_x[lane]);
+		float4 tx1 = (float4::set1(box.max.x) - float4::set1(origin.x)) * float4::load(&inv_x[lane]);
+		float4 ty0 = (float4::set1(box.min.y) - float4::set1(origin.y)) * float4::load(&inv_y[lane]);
+		float4 ty1 = (float4::set1(box.max.y) - float4::set1(origin.y)) * float4::load(&inv_y[lane]);
+		float4 tz0 = (float4::set1(box.min.z) - float4::set1(origin.z)) * float4::load(&inv_z[lane]);
+		float4 tz1 = (float4::set1(box.max.z) - float4::set1(origin.z)) * float4::load(&inv_z[lane]);
+		float4 tnear = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), float4::set1(0.0f)));
+		float4 tfar = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), float4::load(&distance[lane])));
+		return less_equal_mask(tnear, tfar);
+	}
+
+	// narrows the lane range [first, last] to the first and last rays that hit the box, false when none does
+	bool hit_range(const aabb_t& box, uint32_t* first, uint32_t* last) const
+	{
+		uint32_t group = *first / 4, last_group = *last / 4;
+		uint32_t mask = 0;
+		for (; group <= last_group; group++)
+		{
+			mask = hit_mask(box, group) & (0xF << (group == *first / 4 ? *first % 4 : 0)) & (0xF >> (group == last_group ? 3 - *last % 4 : 0));
+			if (mask != 0) break;
+		}
+		if (mask == 0) return false;
+		uint32_t new_first = group * 4;
+		while ((mask & 1) == 0) { mask >>= 1; new_first++; }
+
+		for (uint32_t back = last_group; back + 1 > group; back--) // back >= group would wrap below group 0
+		{
+			mask = hit_mask(box, back) & (0xF >> (back == last_group ? 3 - *last % 4 : 0));
+			if (mask != 0)
+			{
+				uint32_t new_last = back * 4 + 3;
+				while ((mask & 8) == 0) { mask <<= 1; new_last--; }
+				*first = new_first;
+				*last = new_last;
+				return true;
+			}
+		}
+		return false; // not reached, the first lane found hits the box
+	}
+};
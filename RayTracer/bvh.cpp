@@ -0,0 +1,1085 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <immintrin.h>
+
+using namespace std;
+
+static const uint32_t BVH_BINS = 16;
+static const uint32_t BVH_MAX_LEAF_SIZE = 8;
+static const uint32_t BVH_MAX_DEPTH = 60; // keeps traversal within the fixed size stack
+static const uint32_t BVH_STACK_SIZE = 64;
+static const float BVH_TRAVERSAL_COST = 1.0f; // cost of visiting a node relative to a primitive test
+static const uint32_t BVH_SUBTREE_DEPTH = 3; // depth of the subtrees that can be rebuilt after refitting
+static const uint32_t BVH_TREELET_PAIRS = 64; // child pairs per treelet, one pair per cache line so a treelet fills a 4 KB page
+
+// primitives below this count are binned by a single thread
+static const uint32_t BVH_PARALLEL_BIN_SIZE = 1 << 16;
+static const int BVH_PARALLEL_CHUNKS = 64;
+// subtrees below this count are built by a single thread
+static const uint32_t BVH_PARALLEL_SUBTREE_SIZE = 1 << 12;
+static const uint32_t BVH_SUBTREES_PER_THREAD = 8; // extra subtrees keep all threads busy when their sizes differ
+
+struct bvh_range_bounds_t
+{
+	aabb_t bounds, centroid_bounds;
+
+	void clear() { bounds = centroid_bounds = aabb_t::empty(); }
+	void merge(const bvh_range_bounds_t& other) { bounds.grow(other.bounds); centroid_bounds.grow(other.centroid_bounds); }
+};
+
+struct bvh_bins_t
+{
+	aabb_t bounds[3][BVH_BINS];
+	uint32_t counts[3][BVH_BINS];
+
+	void clear()
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			for (uint32_t i = 0; i < BVH_BINS; i++)
+			{
+				bounds[axis][i] = aabb_t::empty();
+				counts[axis][i] = 0;
+			}
+		}
+	}
+
+	void merge(const bvh_bins_t& other)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			for (uint32_t i = 0; i < BVH_BINS; i++)
+			{
+				bounds[axis][i].grow(other.bounds[axis][i]);
+				counts[axis][i] += other.counts[axis][i];
+			}
+		}
+	}
+};
+
+// splits [first, first + count) in fixed chunks processed by all threads and merges their results in order;
+// min/max and integer sums are exact, so the result does not depend on the number of threads
+template<typename result_t, typename process_t>
+static void parallel_reduce(uint32_t first, uint32_t count, result_t* result, process_t process)
+{
+	vector<result_t> partials(BVH_PARALLEL_CHUNKS);
+	uint32_t chunk_size = (count + BVH_PARALLEL_CHUNKS - 1) / BVH_PARALLEL_CHUNKS;
+	#pragma omp parallel for
+	for (int chunk = 0; chunk < BVH_PARALLEL_CHUNKS; chunk++)
+	{
+		partials[chunk].clear();
+		uint32_t chunk_first = first + min(chunk * chunk_size, count);
+		uint32_t chunk_last = first + min((chunk + 1) * chunk_size, count);
+		process(chunk_first, chunk_last - chunk_first, &partials[chunk]);
+	}
+
+	result->clear();
+	for (const auto& partial : partials)
+		result->merge(partial);
+}
+
+struct bvh_builder_t
+{
+	const prim_set_t& prims;
+	vector<uint32_t>& prim_ids; // partitioned in place, each node owns a contiguous range
+	vector<vec3_t> centroids;
+	// splits from rendering threads, which are not OpenMP threads when rendering through renderer_t; a parallel
+	// region opened there would start a whole team per splitting thread
+	bool serial = false;
+
+	bvh_builder_t(const prim_set_t& prims, vector<uint32_t>& prim_ids) : prims(prims), prim_ids(prim_ids)
+	{
+		centroids.resize(prims.size());
+		#pragma omp parallel for if(prims.size() >= BVH_PARALLEL_BIN_SIZE)
+		for (int i = 0; i < (int)prims.size(); i++)
+			centroids[i] = prims.bounds[i].center();
+	}
+
+	// builds the subtree of node_id into nodes; threads building separate subtrees each use their own nodes
+	template<typename nodes_t>
+	void build_node(nodes_t& nodes, uint32_t node_id, uint32_t first, uint32_t count, uint32_t depth)
+	{
+		uint32_t left_count;
+		if (!split_node(nodes, node_id, first, count, depth, &left_count)) return;
+
+		uint32_t left = nodes[node_id].first;
+		build_node(nodes, left, first, left_count, depth + 1);
+		build_node(nodes, left + 1, first + left_count, count - left_count, depth + 1);
+	}
+
+	// either makes node_id a leaf and returns false, or partitions its primitives and allocates its two children
+	template<typename nodes_t>
+	bool split_node(nodes_t& nodes, uint32_t node_id, uint32_t first, uint32_t count, uint32_t depth, uint32_t* left_count)
+	{
+		if (!split_range(first, count, depth, &nodes[node_id].bounds, left_count, nullptr))
+		{
+			nodes[node_id].first = first;
+			nodes[node_id].count = count;
+			return false;
+		}
+
+		uint32_t left = (uint32_t)nodes.size();
+		nodes.push_back({});
+		nodes.push_back({});
+		nodes[node_id].first = left;
+		nodes[node_id].count = 0;
+		return true;
+	}
+
+	// finds the SAH split of [first, first + count) and partitions the primitives around it, or returns false when
+	// they are better left in a leaf; child_bounds, when given, receives the bounds of both sides of the split
+	bool split_range(uint32_t first, uint32_t count, uint32_t depth, aabb_t* bounds, uint32_t* left_count, aabb_t* child_bounds)
+	{
+		bool parallel = !serial && count >= BVH_PARALLEL_BIN_SIZE;
+		bvh_range_bounds_t range;
+		if (parallel) parallel_reduce(first, count, &range, [&](uint32_t f, uint32_t c, bvh_range_bounds_t* r) { grow_range(f, c, r); });
+		else { range.clear(); grow_range(first, count, &range); }
+		*bounds = range.bounds;
+
+		int split_axis = -1;
+		uint32_t split_bin = 0;
+		float split_cost = INFINITY;
+		bvh_bins_t bins;
+		if (count > 1 && depth < BVH_MAX_DEPTH)
+		{
+			const aabb_t& centroid_bounds = range.centroid_bounds;
+			if (parallel) parallel_reduce(first, count, &bins, [&](uint32_t f, uint32_t c, bvh_bins_t* b) { bin_range(f, c, centroid_bounds, b); });
+			else { bins.clear(); bin_range(first, count, centroid_bounds, &bins); }
+			find_split(bins, count, centroid_bounds, &split_axis, &split_bin, &split_cost);
+		}
+
+		// SAH: splitting must be cheaper than testing all primitives, unless the leaf would be too large
+		float leaf_cost = (float)count;
+		split_cost = BVH_TRAVERSAL_COST + split_cost / range.bounds.area();
+		if (split_axis < 0 || (split_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE))
+			return false;
+
+		// partition primitives around the split plane
+		float axis_min = range.centroid_bounds.min[split_axis];
+		float bin_scale = BVH_BINS / (range.centroid_bounds.max[split_axis] - axis_min);
+		uint32_t* middle = partition(&prim_ids[first], &prim_ids[first] + count, [&](uint32_t id)
+			{ return bin_index(centroids[id][split_axis], axis_min, bin_scale) <= split_bin; });
+		*left_count = (uint32_t)(middle - &prim_ids[first]);
+
+		// the bins hold the bounds of the primitives on each side of the plane
+		if (child_bounds != nullptr)
+		{
+			child_bounds[0] = child_bounds[1] = aabb_t::empty();
+			for (uint32_t i = 0; i < BVH_BINS; i++)
+				child_bounds[i <= split_bin ? 0 : 1].grow(bins.bounds[split_axis][i]);
+		}
+		return true;
+	}
+
+	static uint32_t bin_index(float value, float axis_min, float bin_scale)
+	{
+		return min((uint32_t)((value - axis_min) * bin_scale), BVH_BINS - 1);
+	}
+
+	void grow_range(uint32_t first, uint32_t count, bvh_range_bounds_t* range) const
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			range->bounds.grow(prims.bounds[prim_ids[i]]);
+			range->centroid_bounds.grow(centroids[prim_ids[i]]);
+		}
+	}
+
+	void bin_range(uint32_t first, uint32_t count, const aabb_t& centroid_bounds, bvh_bins_t* bins) const
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float axis_min = centroid_bounds.min[axis], axis_max = centroid_bounds.max[axis];
+			if (axis_max <= axis_min) continue; // all centroids in the same plane, nothing to split
+
+			float bin_scale = BVH_BINS / (axis_max - axis_min);
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				uint32_t id = prim_ids[i];
+				uint32_t bin = bin_index(centroids[id][axis], axis_min, bin_scale);
+				bins->counts[axis][bin]++;
+				bins->bounds[axis][bin].grow(prims.bounds[id]);
+			}
+		}
+	}
+
+	// finds the cheapest binned split plane; the cost is left unnormalized by the node area
+	static void find_split(const bvh_bins_t& bins, uint32_t count, const aabb_t& centroid_bounds, int* split_axis, uint32_t* split_bin, float* split_cost)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (centroid_bounds.max[axis] <= centroid_bounds.min[axis]) continue;
+
+			// sweep from the right to get the cost of everything above each plane
+			float right_costs[BVH_BINS];
+			aabb_t right_bounds = aabb_t::empty();
+			uint32_t right_count = 0;
+			for (uint32_t i = BVH_BINS - 1; i > 0; i--)
+			{
+				right_bounds.grow(bins.bounds[axis][i]);
+				right_count += bins.counts[axis][i];
+				right_costs[i - 1] = right_count * right_bounds.area();
+			}
+
+			aabb_t left_bounds = aabb_t::empty();
+			uint32_t left_count = 0;
+			for (uint32_t i = 0; i < BVH_BINS - 1; i++)
+			{
+				left_bounds.grow(bins.bounds[axis][i]);
+				left_count += bins.counts[axis][i];
+				if (left_count == 0 || left_count == count) continue;
+
+				float cost = left_count * left_bounds.area() + right_costs[i];
+				if (cost < *split_cost)
+				{
+					*split_cost = cost;
+					*split_axis = axis;
+					*split_bin = i;
+				}
+			}
+		}
+	}
+
+	void build(bvh_t& bvh)
+	{
+		uint32_t count = (uint32_t)prim_ids.size();
+		bvh.nodes.push_back({});
+		if (count < BVH_PARALLEL_SUBTREE_SIZE)
+		{
+			build_node(bvh.nodes, 0, 0, count, 0);
+			return;
+		}
+
+		// top levels: split the largest node, binning it with all threads, until there are enough subtrees to go around
+		struct task_t { uint32_t node, first, count, depth; };
+		auto smaller = [](const task_t& a, const task_t& b) { return a.count < b.count; };
+		vector<task_t> tasks = { { 0, 0, count, 0 } };
+		uint32_t max_tasks = max(thread::hardware_concurrency(), 1u) * BVH_SUBTREES_PER_THREAD;
+		while (!tasks.empty() && tasks.size() < max_tasks && tasks.front().count >= BVH_PARALLEL_SUBTREE_SIZE)
+		{
+			pop_heap(tasks.begin(), tasks.end(), smaller);
+			task_t task = tasks.back();
+			tasks.pop_back();
+
+			uint32_t left_count;
+			if (!split_node(bvh.nodes, task.node, task.first, task.count, task.depth, &left_count)) continue;
+			uint32_t left = bvh.nodes[task.node].first;
+			tasks.push_back({ left, task.first, left_count, task.depth + 1 });
+			push_heap(tasks.begin(), tasks.end(), smaller);
+			tasks.push_back({ left + 1, task.first + left_count, task.count - left_count, task.depth + 1 });
+			push_heap(tasks.begin(), tasks.end(), smaller);
+		}
+		bvh.build_stats.subtrees = (uint32_t)tasks.size();
+
+		// bottom levels: each thread builds whole subtrees into its own nodes, largest first
+		sort_heap(tasks.begin(), tasks.end(), smaller);
+		reverse(tasks.begin(), tasks.end());
+		vector<vector<bvh_node_t>> subtree_nodes(tasks.size());
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < (int)tasks.size(); i++)
+		{
+			const task_t& task = tasks[i];
+			subtree_nodes[i].reserve(2 * task.count);
+			subtree_nodes[i].push_back({});
+			build_node(subtree_nodes[i], 0, task.first, task.count, task.depth);
+		}
+
+		// append the subtrees in task order so the layout does not depend on thread timing;
+		// node 0 of a subtree is its root, which already exists in the tree
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			const vector<bvh_node_t>& local = subtree_nodes[i];
+			uint32_t offset = (uint32_t)bvh.nodes.size() - 1;
+			for (size_t j = 0; j < local.size(); j++)
+			{
+				bvh_node_t node = local[j];
+				if (!node.is_leaf()) node.first += offset;
+				if (j == 0) bvh.nodes[tasks[i].node] = node;
+				else bvh.nodes.push_back(node);
+			}
+		}
+	}
+};
+
+// spatial bins count the references that start and end in each bin, and bound the parts of them clipped to it
+struct sbvh_spatial_bins_t
+{
+	aabb_t bounds[3][BVH_BINS];
+	uint32_t entries[3][BVH_BINS], exits[3][BVH_BINS];
+};
+
+// SBVH (Stich et al. 2009): besides object splits, a node may be split by a plane that cuts the references
+// straddling it in two, each side keeping the part clipped to it; this is single threaded and builds into bvh
+struct sbvh_builder_t
+{
+	struct ref_t { aabb_t bounds; uint32_t prim; };
+
+	const prim_set_t& prims;
+	bvh_t& bvh;
+	uint32_t budget; // references that spatial splits may still add
+	float min_overlap; // spatial splits are only tried where object split children overlap more than this area
+
+	sbvh_builder_t(const prim_set_t& prims, bvh_t& bvh, uint32_t budget, float min_overlap) :
+		prims(prims), bvh(bvh), budget(budget), min_overlap(min_overlap) {}
+
+	// plane between bin and bin + 1; splits and clipping use the same values
+	static float bin_plane(const aabb_t& bounds, int axis, uint32_t bin)
+	{
+		if (bin + 1 == BVH_BINS) return bounds.max[axis];
+		return bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) * (bin + 1) / BVH_BINS;
+	}
+
+	aabb_t clip_ref(const ref_t& ref, int axis, float min_plane, float max_plane) const
+	{
+		aabb_t slab = ref.bounds;
+		(&slab.min.x)[axis] = maxf(slab.min[axis], min_plane);
+		(&slab.max.x)[axis] = minf(slab.max[axis], max_plane);
+		return prims.objects[ref.prim]->get_clipped_bounds(slab);
+	}
+
+	void find_spatial_split(const vector<ref_t>& refs, const aabb_t& bounds, int* split_axis, uint32_t* split_bin, float* split_cost) const
+	{
+		uint32_t count = (uint32_t)refs.size();
+		sbvh_spatial_bins_t bins;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float axis_min = bounds.min[axis], axis_max = bounds.max[axis];
+			if (axis_max <= axis_min) continue;
+
+			for (uint32_t i = 0; i < BVH_BINS; i++)
+			{
+				bins.bounds[axis][i] = aabb_t::empty();
+				bins.entries[axis][i] = bins.exits[axis][i] = 0;
+			}
+			float bin_scale = BVH_BINS / (axis_max - axis_min);
+			for (const ref_t& ref : refs)
+			{
+				uint32_t first_bin = bvh_builder_t::bin_index(ref.bounds.min[axis], axis_min, bin_scale);
+				uint32_t last_bin = bvh_builder_t::bin_index(ref.bounds.max[axis], axis_min, bin_scale);
+				bins.entries[axis][first_bin]++;
+				bins.exits[axis][last_bin]++;
+				if (first_bin == last_bin)
+				{
+					bins.bounds[axis][first_bin].grow(ref.bounds);
+					continue;
+				}
+				for (uint32_t bin = first_bin; bin <= last_bin; bin++)
+				{
+					float min_plane = bin == 0 ? axis_min : bin_plane(bounds, axis, bin - 1);
+					bins.bounds[axis][bin].grow(clip_ref(ref, axis, min_plane, bin_plane(bounds, axis, bin)));
+				}
+			}
+
+			// same sweeps as the object split, with references counted on both sides of the planes they cross
+			float right_costs[BVH_BINS];
+			uint32_t right_counts[BVH_BINS];
+			aabb_t right_bounds = aabb_t::empty();
+			uint32_t right_count = 0;
+			for (uint32_t i = BVH_BINS - 1; i > 0; i--)
+			{
+				right_bounds.grow(bins.bounds[axis][i]);
+				right_count += bins.exits[axis][i];
+				right_costs[i - 1] = right_count * right_bounds.area();
+				right_counts[i - 1] = right_count;
+			}
+
+			aabb_t left_bounds = aabb_t::empty();
+			uint32_t left_count = 0;
+			for (uint32_t i = 0; i < BVH_BINS - 1; i++)
+			{
+				left_bounds.grow(bins.bounds[axis][i]);
+				left_count += bins.entries[axis][i];
+				if (left_count == 0 || right_counts[i] == 0) continue;
+				if (left_count + right_counts[i] - count > budget) continue; // too many references would be duplicated
+
+				float cost = left_count * left_bounds.area() + right_costs[i];
+				if (cost < *split_cost)
+				{
+					*split_cost = cost;
+					*split_axis = axis;
+					*split_bin = i;
+				}
+			}
+		}
+	}
+
+	void build_node(uint32_t node_id, vector<ref_t>& refs, uint32_t depth)
+	{
+		uint32_t count = (uint32_t)refs.size();
+		aabb_t bounds = aabb_t::empty(), centroid_bounds = aabb_t::empty();
+		for (const ref_t& ref : refs)
+		{
+			bounds.grow(ref.bounds);
+			centroid_bounds.grow(ref.bounds.center());
+		}
+		bvh.nodes[node_id].bounds = bounds;
+
+		int object_axis = -1, spatial_axis = -1;
+		uint32_t object_bin = 0, spatial_bin = 0;
+		float object_cost = INFINITY, spatial_cost = INFINITY;
+		if (count > 1 && depth < BVH_MAX_DEPTH)
+		{
+			bvh_bins_t bins;
+			bins.clear();
+			for (int axis = 0; axis < 3; axis++)
+			{
+				float axis_min = centroid_bounds.min[axis], axis_max = centroid_bounds.max[axis];
+				if (axis_max <= axis_min) continue;
+				float bin_scale = BVH_BINS / (axis_max - axis_min);
+				for (const ref_t& ref : refs)
+				{
+					uint32_t bin = bvh_builder_t::bin_index(ref.bounds.center()[axis], axis_min, bin_scale);
+					bins.counts[axis][bin]++;
+					bins.bounds[axis][bin].grow(ref.bounds);
+				}
+			}
+			bvh_builder_t::find_split(bins, count, centroid_bounds, &object_axis, &object_bin, &object_cost);
+
+			// spatial splits pay off where the children of the object split overlap, typically around large objects
+			aabb_t overlap = aabb_t::empty();
+			if (object_axis >= 0)
+			{
+				aabb_t left = aabb_t::empty(), right = aabb_t::empty();
+				for (uint32_t i = 0; i < BVH_BINS; i++)
+					(i <= object_bin ? left : right).grow(bins.bounds[object_axis][i]);
+				overlap = left.clip(right);
+			}
+			if (budget > 0 && (object_axis < 0 || overlap.area() > min_overlap))
+				find_spatial_split(refs, bounds, &spatial_axis, &spatial_bin, &spatial_cost);
+		}
+
+		// SAH as in bvh_builder_t::split_node
+		float leaf_cost = (float)count;
+		float split_cost = BVH_TRAVERSAL_COST + minf(object_cost, spatial_cost) / bounds.area();
+		bool split = (object_axis >= 0 || spatial_axis >= 0) && (split_cost < leaf_cost || count > BVH_MAX_LEAF_SIZE);
+
+		vector<ref_t> left, right;
+		if (split && spatial_cost < object_cost)
+		{
+			// references crossing the plane go to both sides, unless clipping shows that one side misses the object
+			float plane = bin_plane(bounds, spatial_axis, spatial_bin);
+			for (const ref_t& ref : refs)
+			{
+				if (ref.bounds.max[spatial_axis] <= plane) left.push_back(ref);
+				else if (ref.bounds.min[spatial_axis] >= plane) right.push_back(ref);
+				else
+				{
+					aabb_t left_part = clip_ref(ref, spatial_axis, -INFINITY, plane);
+					aabb_t right_part = clip_ref(ref, spatial_axis, plane, INFINITY);
+					if (!left_part.is_empty()) left.push_back({ left_part, ref.prim });
+					if (!right_part.is_empty()) right.push_back({ right_part, ref.prim });
+					if (left_part.is_empty() && right_part.is_empty()) left.push_back(ref); // lost to rounding, keep it whole
+				}
+			}
+			if (left.empty() || right.empty())
+			{
+				// clipping moved every reference to one side
+				left.clear();
+				right.clear();
+			}
+			else
+			{
+				uint32_t added = (uint32_t)(left.size() + right.size()) - count;
+				budget -= min(added, budget);
+				bvh.build_stats.spatial_splits++;
+			}
+		}
+		if (split && left.empty() && object_axis >= 0)
+		{
+			float axis_min = centroid_bounds.min[object_axis];
+			float bin_scale = BVH_BINS / (centroid_bounds.max[object_axis] - axis_min);
+			for (const ref_t& ref : refs)
+			{
+				bool is_left = bvh_builder_t::bin_index(ref.bounds.center()[object_axis], axis_min, bin_scale) <= object_bin;
+				(is_left ? left : right).push_back(ref);
+			}
+		}
+
+		if (left.empty())
+		{
+			bvh.nodes[node_id].first = (uint32_t)bvh.prim_ids.size();
+			bvh.nodes[node_id].count = count;
+			for (const ref_t& ref : refs)
+				bvh.prim_ids.push_back(ref.prim);
+			return;
+		}
+		vector<ref_t>().swap(refs); // the children own the references from here
+
+		uint32_t left_id = (uint32_t)bvh.nodes.size();
+		bvh.nodes.push_back({});
+		bvh.nodes.push_back({});
+		bvh.nodes[node_id].first = left_id;
+		bvh.nodes[node_id].count = 0;
+		build_node(left_id, left, depth + 1);
+		build_node(left_id + 1, right, depth + 1);
+	}
+};
+
+// collects the nodes at the given depth, or leaves above it
+static void collect_subtrees(const bvh_t& bvh, uint32_t node, uint32_t depth, vector<bvh_t::subtree_t>& subtrees)
+{
+	if (depth == BVH_SUBTREE_DEPTH || bvh.nodes[node].is_leaf())
+	{
+		if (!bvh.nodes[node].is_leaf())
+			subtrees.push_back({ node, bvh.sah_cost(node) });
+		return;
+	}
+	collect_subtrees(bvh, bvh.nodes[node].first, depth + 1, subtrees);
+	collect_subtrees(bvh, bvh.nodes[node].first + 1, depth + 1, subtrees);
+}
+
+void bvh_t::build(const prim_set_t& prims)
+{
+	auto begin = chrono::high_resolution_clock::now();
+	nodes.clear();
+	subtrees.clear();
+	unused_nodes = 0;
+	built_cost = 0.0f;
+	build_stats = {};
+	prim_ids.resize(prims.size());
+	for (uint32_t i = 0; i < prims.size(); i++)
+		prim_ids[i] = i;
+	if (prims.size() == 0) return;
+
+	nodes.reserve(2 * prims.size());
+	bvh_builder_t builder(prims, prim_ids);
+	builder.build(*this);
+
+	built_cost = sah_cost();
+	collect_subtrees(*this, 0, 0, subtrees);
+
+	build_stats.build_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - begin).count();
+	build_stats.nodes = (uint32_t)nodes.size();
+	for (const auto& node : nodes)
+		build_stats.leaves += node.is_leaf() ? 1 : 0;
+}
+
+// overlap, relative to the root area, below which object splits are not compared against spatial splits
+static const float SBVH_MIN_OVERLAP = 1e-5f;
+
+void bvh_t::build_spatial(const prim_set_t& prims, float max_reference_growth)
+{
+	auto begin = chrono::high_resolution_clock::now();
+	nodes.clear();
+	subtrees.clear();
+	unused_nodes = 0;
+	built_cost = 0.0f;
+	build_stats = {};
+	prim_ids.clear();
+	if (prims.size() == 0) return;
+
+	vector<sbvh_builder_t::ref_t> refs(prims.size());
+	aabb_t root_bounds = aabb_t::empty();
+	for (uint32_t i = 0; i < prims.size(); i++)
+	{
+		refs[i] = { prims.bounds[i], i };
+		root_bounds.grow(prims.bounds[i]);
+	}
+
+	uint32_t budget = (uint32_t)(max_reference_growth * prims.size());
+	prim_ids.reserve(prims.size() + budget);
+	nodes.reserve(2 * (prims.size() + budget));
+	nodes.push_back({});
+	sbvh_builder_t builder(prims, *this, budget, SBVH_MIN_OVERLAP * root_bounds.area());
+	builder.build_node(0, refs, 0);
+
+	built_cost = sah_cost();
+	collect_subtrees(*this, 0, 0, subtrees);
+
+	build_stats.build_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - begin).count();
+	build_stats.nodes = (uint32_t)nodes.size();
+	for (const auto& node : nodes)
+		build_stats.leaves += node.is_leaf() ? 1 : 0;
+}
+
+void bvh_t::refit(const prim_set_t& prims)
+{
+	// children always come after their parent, so a reverse sweep visits them first
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		bvh_node_t& node = nodes[i];
+		node.bounds = aabb_t::empty();
+		if (node.is_leaf())
+		{
+			for (uint32_t j = node.first; j < node.first + node.count; j++)
+				node.bounds.grow(prims.bounds[prim_ids[j]]);
+		}
+		else
+		{
+			node.bounds.grow(nodes[node.first].bounds);
+			node.bounds.grow(nodes[node.first + 1].bounds);
+		}
+	}
+}
+
+static uint32_t subtree_size(const bvh_t& bvh, uint32_t node)
+{
+	if (bvh.nodes[node].is_leaf()) return 1;
+	return 1 + subtree_size(bvh, bvh.nodes[node].first) + subtree_size(bvh, bvh.nodes[node].first + 1);
+}
+
+uint32_t bvh_t::rebuild_subtrees(const prim_set_t& prims, float max_cost_growth)
+{
+	unique_ptr<bvh_builder_t> builder;
+	uint32_t rebuilt = 0;
+	for (auto& subtree : subtrees)
+	{
+		if (sah_cost(subtree.node) <= subtree.cost * max_cost_growth) continue;
+
+		// the primitives of a subtree are contiguous in prim_ids, from its leftmost to its rightmost leaf
+		uint32_t leftmost = subtree.node, rightmost = subtree.node;
+		while (!nodes[leftmost].is_leaf()) leftmost = nodes[leftmost].first;
+		while (!nodes[rightmost].is_leaf()) rightmost = nodes[rightmost].first + 1;
+		uint32_t first = nodes[leftmost].first;
+		uint32_t count = nodes[rightmost].first + nodes[rightmost].count - first;
+
+		// the subtree root is reused in place, its old descendants become unreachable
+		if (!builder) builder = make_unique<bvh_builder_t>(prims, prim_ids);
+		unused_nodes += subtree_size(*this, subtree.node) - 1;
+		builder->build_node(nodes, subtree.node, first, count, BVH_SUBTREE_DEPTH);
+		subtree.cost = sah_cost(subtree.node);
+		rebuilt++;
+	}
+	return rebuilt;
+}
+
+void bvh_t::reorder(bvh_layout_t layout)
+{
+	if (layout == BVH_LAYOUT_BUILD || nodes.size() < 3) return;
+
+	// node 1 is padding so that every sibling pair starts on a cache line
+	const uint32_t UNPLACED = 0xFFFFFFFF;
+	bvh_nodes_t ordered;
+	ordered.reserve(nodes.size() + 1);
+	ordered.push_back(nodes[0]);
+	ordered.push_back({ aabb_t::empty(), 0, 0 });
+	vector<uint32_t> new_ids(nodes.size(), UNPLACED);
+	new_ids[0] = 0;
+
+	// each treelet starts at a node whose children are not placed yet and grows by placing the children of its
+	// largest node, the one most likely to be entered; parents are always placed before their children
+	vector<uint32_t> roots = { 0 };
+	vector<uint32_t> frontier;
+	for (size_t next_root = 0; next_root < roots.size(); next_root++)
+	{
+		frontier.assign(1, roots[next_root]);
+		for (uint32_t pairs = 0; pairs < BVH_TREELET_PAIRS && !frontier.empty(); pairs++)
+		{
+			size_t largest = 0;
+			for (size_t i = 1; i < frontier.size(); i++)
+				if (nodes[frontier[i]].bounds.area() > nodes[frontier[largest]].bounds.area())
+					largest = i;
+			uint32_t parent = frontier[largest];
+			frontier[largest] = frontier.back();
+			frontier.pop_back();
+
+			uint32_t child = nodes[parent].first, new_child = (uint32_t)ordered.size();
+			ordered[new_ids[parent]].first = new_child;
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				new_ids[child + i] = new_child + i;
+				ordered.push_back(nodes[child + i]);
+				if (!nodes[child + i].is_leaf()) frontier.push_back(child + i);
+			}
+		}
+		roots.insert(roots.end(), frontier.begin(), frontier.end());
+	}
+
+	nodes.swap(ordered);
+	for (auto& subtree : subtrees)
+		subtree.node = new_ids[subtree.node];
+	unused_nodes = 0; // unreachable nodes are not copied
+}
+
+float bvh_t::sah_cost(uint32_t node_id) const
+{
+	if (nodes.empty()) return 0.0f;
+
+	// sum of the costs of all nodes weighted by their area
+	float cost = 0.0f;
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = node_id;
+	while (stack_size > 0)
+	{
+		const bvh_node_t& node = nodes[stack[--stack_size]];
+		if (node.is_leaf())
+		{
+			cost += node.bounds.area() * node.count;
+		}
+		else
+		{
+			cost += node.bounds.area() * BVH_TRAVERSAL_COST;
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = node.first + 1;
+		}
+	}
+
+	float area = nodes[node_id].bounds.area();
+	return area > 0.0f ? cost / area : 0.0f;
+}
+
+// traversal observers get the address of every node read, see bvh_observer_t
+struct bvh_no_observer_t { void visit(const void*) {} };
+struct bvh_observer_ref_t
+{
+	bvh_observer_t* observer;
+	void visit(const void* address) { observer->visit(address); }
+};
+
+template<bool PREFETCH, typename observer_t>
+static float bvh_intersect(const bvh_t& bvh, const prim_set_t& prims, const ray_t& ray, uint32_t* prim, observer_t observer)
+{
+	const auto& nodes = bvh.nodes;
+	float distance = INFINITY;
+	if (nodes.empty()) return distance;
+
+	slab_ray_t slab(ray);
+	struct { uint32_t node; float entry; } stack[BVH_STACK_SIZE];
+	uint32_t stack_size = 0;
+
+	observer.visit(&nodes[0]);
+	if (slab.hit(nodes[0].bounds, distance) < INFINITY)
+		stack[stack_size++] = { 0, 0.0f };
+
+	while (stack_size > 0)
+	{
+		auto entry = stack[--stack_size];
+		if (entry.entry >= distance) continue; // a closer hit was found after this node was pushed
+
+		const bvh_node_t* node = &nodes[entry.node];
+		observer.visit(node);
+		while (!node->is_leaf())
+		{
+			// visit the closer child first and defer the other one
+			uint32_t near_id = node->first, far_id = node->first + 1;
+			observer.visit(&nodes[near_id]);
+			observer.visit(&nodes[far_id]);
+			float near_entry = slab.hit(nodes[near_id].bounds, distance);
+			float far_entry = slab.hit(nodes[far_id].bounds, distance);
+			if (far_entry < near_entry)
+			{
+				swap(near_id, far_id);
+				swap(near_entry, far_entry);
+			}
+
+			if (near_entry == INFINITY) break;
+			if (far_entry < INFINITY)
+			{
+				// the children of the deferred node are read when it is popped, start loading them now
+				if (PREFETCH && !nodes[far_id].is_leaf())
+					_mm_prefetch((const char*)&nodes[nodes[far_id].first], _MM_HINT_T0);
+				stack[stack_size++] = { far_id, far_entry };
+			}
+			node = &nodes[near_id];
+		}
+
+		if (node->is_leaf())
+			prims.intersect(&bvh.prim_ids[node->first], node->count, ray, &distance, prim);
+	}
+
+	return distance;
+}
+
+void bvh_t::intersect(const prim_set_t& prims, ray_packet_t* packet) const
+{
+	if (nodes.empty() || packet->size == 0) return;
+	packet->finish();
+
+	// the children are visited in the order that suits the average direction of the packet
+	vec3_t direction = { 0.0f, 0.0f, 0.0f };
+	for (uint32_t lane = 0; lane < packet->size; lane++)
+		direction += vec3_t{ packet->dir_x[lane], packet->dir_y[lane], packet->dir_z[lane] };
+
+	struct { uint32_t node, first, last; } stack[BVH_STACK_SIZE];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = { 0, 0, packet->size - 1 };
+
+	while (stack_size > 0)
+	{
+		auto entry = stack[--stack_size];
+		// lanes may have found closer hits after the node was pushed
+		if (!packet->hit_range(nodes[entry.node].bounds, &entry.first, &entry.last)) continue;
+
+		const bvh_node_t* node = &nodes[entry.node];
+		while (!node->is_leaf())
+		{
+			uint32_t near_id = node->first, far_id = node->first + 1;
+			if (((nodes[far_id].bounds.center() - nodes[near_id].bounds.center()) * direction).sum() < 0.0f)
+				swap(near_id, far_id);
+
+			uint32_t near_first = entry.first, near_last = entry.last;
+			uint32_t far_first = entry.first, far_last = entry.last;
+			bool near_hit = packet->hit_range(nodes[near_id].bounds, &near_first, &near_last);
+			bool far_hit = packet->hit_range(nodes[far_id].bounds, &far_first, &far_last);
+			if (!near_hit && !far_hit) break;
+			if (!near_hit)
+			{
+				near_id = far_id;
+				near_first = far_first;
+				near_last = far_last;
+			}
+			else if (far_hit)
+			{
+				stack[stack_size++] = { far_id, far_first, far_last };
+			}
+			node = &nodes[near_id];
+			entry.first = near_first;
+			entry.last = near_last;
+		}
+
+		if (!node->is_leaf()) continue;
+		const uint32_t* ids = &prim_ids[node->first];
+		for (uint32_t group = entry.first / 4; group <= entry.last / 4; group++)
+		{
+			uint32_t mask = packet->hit_mask(node->bounds, group);
+			for (uint32_t lane = group * 4; mask != 0; lane++, mask >>= 1)
+				if ((mask & 1) != 0 && lane >= entry.first && lane <= entry.last)
+					prims.intersect(ids, node->count, packet->ray(lane), &packet->distance[lane], &packet->prim[lane]);
+		}
+	}
+}
+
+template<typename observer_t>
+static bool bvh_occluded(const bvh_t& bvh, const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder, observer_t observer)
+{
+	const auto& nodes = bvh.nodes;
+	if (nodes.empty()) return false;
+
+	slab_ray_t slab(ray);
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		const bvh_node_t& node = nodes[stack[--stack_size]];
+		observer.visit(&node);
+		if (slab.hit(node.bounds, tmax) == INFINITY) continue;
+
+		if (node.is_leaf())
+		{
+			if (prims.occluded(&bvh.prim_ids[node.first], node.count, ray, tmax, ignore, occluder))
+				return true;
+		}
+		else
+		{
+			stack[stack_size++] = node.first + 1;
+			stack[stack_size++] = node.first;
+		}
+	}
+
+	return false;
+}
+
+float bvh_t::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	return prefetch ? bvh_intersect<true>(*this, prims, ray, prim, bvh_no_observer_t())
+		: bvh_intersect<false>(*this, prims, ray, prim, bvh_no_observer_t());
+}
+
+float bvh_t::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim, bvh_observer_t* observer) const
+{
+	return bvh_intersect<false>(*this, prims, ray, prim, bvh_observer_ref_t{ observer });
+}
+
+bool bvh_t::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	return bvh_occluded(*this, prims, ray, tmax, ignore, occluder, bvh_no_observer_t());
+}
+
+bool bvh_t::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder, bvh_observer_t* observer) const
+{
+	return bvh_occluded(*this, prims, ray, tmax, ignore, occluder, bvh_observer_ref_t{ observer });
+}
+
+static const uint32_t LAZY_BVH_TOP_DEPTH = 6; // levels split by build(), so threads do not all wait on the root
+static_assert((2u << LAZY_BVH_TOP_DEPTH) - 1 <= lazy_bvh_t::BLOCK_SIZE, "the top levels must fit in the first node block");
+
+lazy_bvh_t::lazy_bvh_t() : node_count(0) {}
+lazy_bvh_t::~lazy_bvh_t() { clear(); }
+
+void lazy_bvh_t::clear()
+{
+	for (uint32_t i = 0; i < block_count; i++)
+		delete[] blocks[i].load();
+	blocks.reset();
+	block_count = 0;
+	node_count = 0;
+	builder.reset();
+	prim_ids.clear();
+	build_ms = 0.0;
+	built_memory = 0;
+}
+
+void lazy_bvh_t::build(const prim_set_t& prims)
+{
+	auto begin = chrono::high_resolution_clock::now();
+	clear();
+	if (prims.size() == 0) return;
+
+	prim_ids.resize(prims.size());
+	for (uint32_t i = 0; i < prims.size(); i++)
+		prim_ids[i] = i;
+	builder = make_unique<bvh_builder_t>(prims, prim_ids);
+
+	// a tree with a primitive per leaf has 2 * count - 1 nodes
+	block_count = (2 * prims.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blocks = make_unique<atomic<lazy_bvh_node_t*>[]>(block_count);
+	for (uint32_t i = 0; i < block_count; i++)
+		blocks[i] = nullptr;
+
+	blocks[0] = new lazy_bvh_node_t[BLOCK_SIZE];
+	node_count = 1;
+	lazy_bvh_node_t& root = node(0);
+	root.bounds = aabb_t::empty();
+	for (const aabb_t& bounds : prims.bounds)
+		root.bounds.grow(bounds);
+	root.first = 0;
+	root.count = prims.size();
+	root.depth = 0;
+	root.children = LAZY_BVH_UNBUILT;
+
+	// nodes are allocated level by level from here, so this visits the top levels breadth first
+	for (uint32_t i = 0; i < node_count && node(i).depth < LAZY_BVH_TOP_DEPTH; i++)
+		enter(node(i));
+	builder->serial = true; // the remaining nodes are split by the rays
+	built_memory = node_memory();
+
+	build_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - begin).count();
+}
+
+size_t lazy_bvh_t::node_memory() const
+{
+	size_t bytes = 0;
+	for (uint32_t i = 0; i < block_count; i++)
+		bytes += blocks[i].load() != nullptr ? BLOCK_SIZE * sizeof(lazy_bvh_node_t) : 0;
+	return bytes;
+}
+
+uint32_t lazy_bvh_t::allocate_pair() const
+{
+	uint32_t left = node_count.fetch_add(2);
+	for (uint32_t block = left / BLOCK_SIZE; block <= (left + 1) / BLOCK_SIZE; block++)
+	{
+		if (blocks[block].load(memory_order_acquire) != nullptr) continue;
+		lock_guard<mutex> lock(block_mutex);
+		if (blocks[block].load(memory_order_relaxed) == nullptr)
+			blocks[block].store(new lazy_bvh_node_t[BLOCK_SIZE], memory_order_release);
+	}
+	return left;
+}
+
+uint32_t lazy_bvh_t::expand(lazy_bvh_node_t& node) const
+{
+	// the first thread to enter the node splits it, the others wait for the children it publishes
+	uint32_t children = LAZY_BVH_UNBUILT;
+	if (!node.children.compare_exchange_strong(children, LAZY_BVH_BUILDING, memory_order_acquire))
+	{
+		while ((children = node.children.load(memory_order_acquire)) == LAZY_BVH_BUILDING)
+			this_thread::yield();
+		return children;
+	}
+
+	// the primitive range of an unbuilt node is only touched by the thread splitting it
+	aabb_t bounds, child_bounds[2];
+	uint32_t left_count;
+	children = LAZY_BVH_LEAF;
+	if (builder->split_range(node.first, node.count, node.depth, &bounds, &left_count, child_bounds))
+	{
+		children = allocate_pair();
+		uint32_t firsts[2] = { node.first, node.first + left_count };
+		uint32_t counts[2] = { left_count, node.count - left_count };
+		for (uint32_t i = 0; i < 2; i++)
+		{
+			lazy_bvh_node_t& child = this->node(children + i);
+			child.bounds = child_bounds[i];
+			child.first = firsts[i];
+			child.count = counts[i];
+			child.depth = node.depth + 1;
+			child.children.store(LAZY_BVH_UNBUILT, memory_order_relaxed);
+		}
+	}
+	node.children.store(children, memory_order_release);
+	return children;
+}
+
+float lazy_bvh_t::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	float distance = INFINITY;
+	if (node_count == 0) return distance;
+
+	slab_ray_t slab(ray);
+	struct { uint32_t node; float entry; } stack[BVH_STACK_SIZE];
+	uint32_t stack_size = 0;
+
+	if (slab.hit(node(0).bounds, distance) < INFINITY)
+		stack[stack_size++] = { 0, 0.0f };
+
+	while (stack_size > 0)
+	{
+		auto entry = stack[--stack_size];
+		if (entry.entry >= distance) continue; // a closer hit was found after this node was pushed
+
+		lazy_bvh_node_t* current = &node(entry.node);
+		for (;;)
+		{
+			uint32_t children = enter(*current);
+			if (children == LAZY_BVH_LEAF)
+			{
+				prims.intersect(&prim_ids[current->first], current->count, ray, &distance, prim);
+				break;
+			}
+
+			// visit the closer child first and defer the other one
+			uint32_t near_id = children, far_id = children + 1;
+			float near_entry = slab.hit(node(near_id).bounds, distance);
+			float far_entry = slab.hit(node(far_id).bounds, distance);
+			if (far_entry < near_entry)
+			{
+				swap(near_id, far_id);
+				swap(near_entry, far_entry);
+			}
+
+			if (near_entry == INFINITY) break;
+			if (far_entry < INFINITY)
+				stack[stack_size++] = { far_id, far_entry };
+			current = &node(near_id);
+		}
+	}
+
+	return distance;
+}
+
+bool lazy_bvh_t::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	if (node_count == 0) return false;
+
+	slab_ray_t slab(ray);
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		lazy_bvh_node_t& current = node(stack[--stack_size]);
+		if (slab.hit(current.bounds, tmax) == INFINITY) continue;
+
+		uint32_t children = enter(current);
+		if (children == LAZY_BVH_LEAF)
+		{
+			if (prims.occluded(&prim_ids[current.first], current.count, ray, tmax, ignore, occluder))
+				return true;
+		}
+		else
+		{
+			stack[stack_size++] = children + 1;
+			stack[stack_size++] = children;
+		}
+	}
+
+	return false;
+}
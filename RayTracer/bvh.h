@@ -0,0 +1,134 @@
+#pragma once
+
+#include "accel.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+struct bvh_node_t
+{
+	aabb_t bounds;
+	uint32_t first; // leaves: first entry in prim_ids, interior nodes: left child (right child is first + 1)
+	uint32_t count; // number of primitives in a leaf, 0 for interior nodes
+
+	bool is_leaf() const { return count != 0; }
+};
+
+struct bvh_build_stats_t
+{
+	double build_ms;
+	uint32_t nodes, leaves;
+	uint32_t subtrees; // subtrees built in parallel, 0 when the scene is too small to split the work
+	uint32_t spatial_splits; // nodes whose split plane cut primitives in two, see bvh_t::build_spatial
+};
+
+// receives the address of every node read by a traversal, used to simulate its cache behavior
+struct bvh_observer_t
+{
+	virtual void visit(const void* address) = 0;
+	virtual ~bvh_observer_t() {}
+};
+
+typedef std::vector<bvh_node_t, aligned_allocator_t<bvh_node_t, 64>> bvh_nodes_t;
+
+struct bvh_t
+{
+	bvh_nodes_t nodes; // root is node 0, children are always allocated in pairs after their parent
+	std::vector<uint32_t> prim_ids; // primitive indices, referenced by leaves
+
+	// subtrees that can be rebuilt on their own once refitting has degraded them
+	struct subtree_t { uint32_t node; float cost; };
+	std::vector<subtree_t> subtrees;
+	float built_cost = 0.0f; // SAH cost right after the last full build
+	uint32_t unused_nodes = 0; // nodes left unreachable by subtree rebuilds
+	bvh_build_stats_t build_stats = {}; // of the last full build
+	bool prefetch = false; // prefetch the children of deferred nodes during closest hit traversal
+
+	// binned SAH build; the top levels are split with all threads binning together,
+	// then the remaining subtrees are built by separate threads
+	void build(const prim_set_t& prims);
+	// single threaded SBVH build, where references to the primitives crossing a split plane may be cut in two;
+	// at most max_reference_growth * prims.size() references are added, so prim_ids can list a primitive more than once
+	void build_spatial(const prim_set_t& prims, float max_reference_growth);
+	// recomputes node bounds bottom-up after primitives moved or changed size, keeping the topology
+	void refit(const prim_set_t& prims);
+	// rebuilds the subtrees whose SAH cost grew past the threshold since they were built, returns how many
+	uint32_t rebuild_subtrees(const prim_set_t& prims, float max_cost_growth);
+	// changes the order in which nodes are stored, keeping the tree; BVH_LAYOUT_TREELET leaves node 1 unused
+	void reorder(bvh_layout_t layout);
+	// SAH cost of the subtree normalized by its root area (expected cost of a ray that hits the root)
+	float sah_cost(uint32_t node = 0) const;
+
+	// returns the distance to the closest hit (INFINITY if nothing is hit) and the primitive that was hit
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const;
+	// stops at the first primitive found between the ray origin and tmax
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder = nullptr) const;
+
+	// finds the closest hit of every lane of the packet; nodes are tested for the range of lanes still hitting
+	// their parent and skipped when none of them enters the node, leaves only test the lanes that enter them
+	void intersect(const prim_set_t& prims, ray_packet_t* packet) const;
+
+	// same traversals reporting the nodes they read, without prefetching
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim, bvh_observer_t* observer) const;
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder, bvh_observer_t* observer) const;
+};
+
+struct bvh_builder_t;
+
+static const uint32_t LAZY_BVH_UNBUILT = 0xFFFFFFFF;
+static const uint32_t LAZY_BVH_BUILDING = 0xFFFFFFFE;
+static const uint32_t LAZY_BVH_LEAF = 0xFFFFFFFD;
+
+struct lazy_bvh_node_t
+{
+	aabb_t bounds;
+	uint32_t first, count; // range of the primitives below the node in prim_ids
+	uint32_t depth;
+	std::atomic<uint32_t> children; // LAZY_BVH_UNBUILT until a ray enters the node, then LAZY_BVH_LEAF or the left child
+};
+
+// binary BVH whose nodes are split the first time a ray enters them, so rendering starts after building only the
+// top levels and parts of the scene that no ray reaches are never built; the split is the one bvh_t makes, so a
+// fully expanded tree matches it. Nodes live in blocks that never move, which lets one thread split a node while
+// others traverse the rest of the tree
+struct lazy_bvh_t
+{
+	static const uint32_t BLOCK_SIZE = 256; // nodes, the first block holds the top levels built up front
+
+	std::vector<uint32_t> prim_ids; // primitive indices, partitioned as nodes are split
+	std::unique_ptr<std::atomic<lazy_bvh_node_t*>[]> blocks; // enough block slots for a fully expanded tree
+	uint32_t block_count = 0;
+	mutable std::atomic<uint32_t> node_count; // root is node 0, children are allocated in pairs
+	mutable std::mutex block_mutex;
+	std::unique_ptr<bvh_builder_t> builder; // kept to split nodes during traversal
+	double build_ms = 0.0;
+	size_t built_memory = 0; // bytes of node blocks allocated by build(), before any ray
+
+	lazy_bvh_t();
+	~lazy_bvh_t();
+
+	// builds the top levels; prims must stay unchanged while the hierarchy is in use
+	void build(const prim_set_t& prims);
+	void clear();
+	// bytes of node blocks allocated so far
+	size_t node_memory() const;
+
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const;
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder = nullptr) const;
+
+	lazy_bvh_node_t& node(uint32_t index) const
+	{
+		return blocks[index / BLOCK_SIZE].load(std::memory_order_acquire)[index % BLOCK_SIZE];
+	}
+
+	// returns the children of the node, splitting it first if no ray entered it before
+	uint32_t enter(lazy_bvh_node_t& node) const
+	{
+		uint32_t children = node.children.load(std::memory_order_acquire);
+		return children > LAZY_BVH_LEAF ? expand(node) : children;
+	}
+
+	uint32_t expand(lazy_bvh_node_t& node) const;
+	uint32_t allocate_pair() const;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// set associative cache with LRU replacement, counts the misses of a stream of addresses;
+// used to compare node layouts without relying on platform specific hardware counters
+struct cache_sim_t
+{
+	static const uint32_t LINE_SIZE = 64;
+
+	uint32_t sets, ways;
+	std::vector<uint64_t> lines; // per set, most recently used first; 0 is an empty way
+	uint64_t accesses = 0, misses = 0;
+
+	cache_sim_t(uint32_t size, uint32_t ways) : sets(size / (LINE_SIZE * ways)), ways(ways), lines(sets * ways, 0) {}
+	uint32_t size() const { return sets * ways * LINE_SIZE; }
+
+	// returns true on a hit
+	bool access(uint64_t address)
+	{
+		uint64_t line = address / LINE_SIZE + 1;
+		uint64_t* set = &lines[(line % sets) * ways];
+		accesses++;
+
+		uint32_t way = 0;
+		while (way < ways - 1 && set[way] != line) way++;
+		bool hit = set[way] == line;
+		if (!hit) misses++;
+
+		// move the line to the front, evicting the last one on a miss
+		for (; way > 0; way--)
+			set[way] = set[way - 1];
+		set[0] = line;
+		return hit;
+	}
+};
+
+// two level hierarchy, the second level only sees the misses of the first one
+struct cache_hierarchy_sim_t
+{
+	cache_sim_t l1, l2;
+
+	cache_hierarchy_sim_t() : l1(32 * 1024, 8), l2(1024 * 1024, 16) {}
+
+	void access(const void* address)
+	{
+		uint64_t a = (uint64_t)(uintptr_t)address;
+		if (!l1.access(a)) l2.access(a);
+	}
+};
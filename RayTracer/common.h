@@ -8,6 +8,10 @@
 static inline uint8_t to_byte(float v) { return (uint8_t)(v * 255.0f); }
 static inline float from_byte(uint8_t v) { return v * (1.0f / 255.0f); }
 
+// unlike fminf/fmaxf these compile down to single min/max instructions
+static inline float minf(float a, float b) { return a < b ? a : b; }
+static inline float maxf(float a, float b) { return a > b ? a : b; }
+
 static inline float clamp(float v, float low, float up) { return (float)fmax(fmin(v, up), low); }
 
 static const float DEG_TO_RAD = 0.017453292519943295769236907684886f;
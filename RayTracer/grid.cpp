@@ -0,0 +1,152 @@
+#include "grid.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const float GRID_DENSITY = 3.0f; // cells per primitive
+static const uint32_t GRID_MAX_RES = 1024; // per axis
+
+void grid_t::build(const prim_set_t& prims)
+{
+	bounds = aabb_t::empty();
+	for (const auto& prim_bounds : prims.bounds)
+		bounds.grow(prim_bounds);
+	cell_starts.assign(2, 0);
+	prim_ids.clear();
+	res[0] = res[1] = res[2] = 1;
+	if (prims.size() == 0) return;
+
+	// pick cubic-ish cells so the grid holds about GRID_DENSITY cells per primitive
+	vec3_t extent = bounds.extent();
+	const float min_extent = 0.0001f;
+	extent = { maxf(extent.x, min_extent), maxf(extent.y, min_extent), maxf(extent.z, min_extent) };
+	float cells_per_unit = cbrtf(GRID_DENSITY * prims.size() / (extent.x * extent.y * extent.z));
+	for (int axis = 0; axis < 3; axis++)
+		res[axis] = (uint32_t)clamp(extent[axis] * cells_per_unit, 1.0f, (float)GRID_MAX_RES);
+
+	cell_size = { extent.x / res[0], extent.y / res[1], extent.z / res[2] };
+	inv_cell_size = { 1.0f / cell_size.x, 1.0f / cell_size.y, 1.0f / cell_size.z };
+
+	// every primitive goes into all cells overlapped by its bounds; count first, then fill
+	auto cell_range = [&](const aabb_t& box, uint32_t* lo, uint32_t* hi)
+	{
+		vec3_t rel_min = (box.min - bounds.min) * inv_cell_size, rel_max = (box.max - bounds.min) * inv_cell_size;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			lo[axis] = (uint32_t)clamp(rel_min[axis], 0.0f, (float)(res[axis] - 1));
+			hi[axis] = (uint32_t)clamp(rel_max[axis], 0.0f, (float)(res[axis] - 1));
+		}
+	};
+
+	uint32_t cell_count = res[0] * res[1] * res[2];
+	cell_starts.assign(cell_count + 1, 0);
+	for (uint32_t pass = 0; pass < 2; pass++)
+	{
+		for (uint32_t prim = 0; prim < prims.size(); prim++)
+		{
+			uint32_t lo[3], hi[3];
+			cell_range(prims.bounds[prim], lo, hi);
+			for (uint32_t z = lo[2]; z <= hi[2]; z++)
+				for (uint32_t y = lo[1]; y <= hi[1]; y++)
+					for (uint32_t x = lo[0]; x <= hi[0]; x++)
+					{
+						uint32_t cell = cell_index(x, y, z);
+						if (pass == 0) cell_starts[cell + 1]++;
+						else prim_ids[cell_starts[cell]++] = prim;
+					}
+		}
+
+		if (pass == 0)
+		{
+			for (uint32_t cell = 0; cell < cell_count; cell++)
+				cell_starts[cell + 1] += cell_starts[cell];
+			prim_ids.resize(cell_starts[cell_count]);
+		}
+		else
+		{
+			// filling moved every start to the end of its cell, which is the start of the next one
+			for (uint32_t cell = cell_count; cell > 0; cell--)
+				cell_starts[cell] = cell_starts[cell - 1];
+			cell_starts[0] = 0;
+		}
+	}
+}
+
+// walks the cells pierced by the ray in front to back order until visit() returns true or tmax is passed;
+// visit() gets the primitives of the cell and the distance at which the ray leaves it
+template<typename visitor_t>
+static void grid_walk(const grid_t& grid, const ray_t& ray, float tmax, visitor_t visit)
+{
+	slab_ray_t slab(ray);
+	float tenter = slab.hit(grid.bounds, tmax);
+	if (tenter == INFINITY) return;
+
+	vec3_t start = (ray.origin + ray.direction * tenter - grid.bounds.min) * grid.inv_cell_size;
+	int cell[3], step[3], end[3];
+	float next_t[3], delta_t[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		cell[axis] = (int)clamp(start[axis], 0.0f, (float)(grid.res[axis] - 1));
+		float dir = ray.direction[axis];
+		float origin = ray.origin[axis] - grid.bounds.min[axis];
+		if (dir > 0.0f)
+		{
+			step[axis] = 1;
+			end[axis] = (int)grid.res[axis];
+			next_t[axis] = ((cell[axis] + 1) * grid.cell_size[axis] - origin) / dir;
+			delta_t[axis] = grid.cell_size[axis] / dir;
+		}
+		else if (dir < 0.0f)
+		{
+			step[axis] = -1;
+			end[axis] = -1;
+			next_t[axis] = (cell[axis] * grid.cell_size[axis] - origin) / dir;
+			delta_t[axis] = -grid.cell_size[axis] / dir;
+		}
+		else
+		{
+			step[axis] = 0;
+			end[axis] = -1;
+			next_t[axis] = INFINITY;
+			delta_t[axis] = INFINITY;
+		}
+	}
+
+	for (;;)
+	{
+		int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+		uint32_t index = grid.cell_index(cell[0], cell[1], cell[2]);
+		uint32_t first = grid.cell_starts[index], count = grid.cell_starts[index + 1] - first;
+		if (count > 0 && visit(&grid.prim_ids[first], count, next_t[axis]))
+			return;
+
+		if (next_t[axis] > tmax) return;
+		cell[axis] += step[axis];
+		if (cell[axis] == end[axis]) return;
+		next_t[axis] += delta_t[axis];
+	}
+}
+
+float grid_t::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	float distance = INFINITY;
+	grid_walk(*this, ray, INFINITY, [&](const uint32_t* ids, uint32_t count, float cell_exit)
+	{
+		// objects span several cells, a hit beyond this cell may still be beaten by one in the next cells
+		prims.intersect(ids, count, ray, &distance, prim);
+		return distance <= cell_exit;
+	});
+	return distance;
+}
+
+bool grid_t::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	bool occluded = false;
+	grid_walk(*this, ray, tmax, [&](const uint32_t* ids, uint32_t count, float)
+	{
+		occluded = prims.occluded(ids, count, ray, tmax, ignore, occluder);
+		return occluded;
+	});
+	return occluded;
+}
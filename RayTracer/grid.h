@@ -0,0 +1,22 @@
+#pragma once
+
+#include "accel.h"
+
+#include <vector>
+
+// uniform grid traversed with a 3D-DDA, suited to many evenly spread objects of similar size
+struct grid_t
+{
+	aabb_t bounds;
+	uint32_t res[3];
+	vec3_t cell_size, inv_cell_size;
+	std::vector<uint32_t> cell_starts; // cell i lists prim_ids[cell_starts[i]..cell_starts[i + 1]]
+	std::vector<uint32_t> prim_ids;
+
+	void build(const prim_set_t& prims);
+
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const;
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder = nullptr) const;
+
+	uint32_t cell_index(uint32_t x, uint32_t y, uint32_t z) const { return x + res[0] * (y + res[1] * z); }
+};
@@ -0,0 +1,119 @@
+#include "instance.h"
+
+#include <assert.h>
+
+using namespace std;
+
+// closest instance hit found so far for the last ray intersect() saw on this thread, so that get_surface() does not
+// trace the group again for the hit the traversal settled on. Rays of a packet are intersected in turn and replace
+// each other, get_surface() then traces the group again
+struct instance_hit_t
+{
+	const instance_t* instance;
+	ray_t ray;
+	float distance;
+	uint32_t prim; // in the group
+};
+
+static thread_local instance_hit_t t_last_hit = { nullptr, {}, INFINITY, PRIM_NONE };
+
+static bool same_ray(const ray_t& a, const ray_t& b)
+{
+	return a.origin.x == b.origin.x && a.origin.y == b.origin.y && a.origin.z == b.origin.z &&
+		a.direction.x == b.direction.x && a.direction.y == b.direction.y && a.direction.z == b.direction.z;
+}
+
+void group_t::add_object(unique_ptr<object_t> object)
+{
+	objects.push_back(move(object));
+	built = false;
+}
+
+void group_t::build()
+{
+	for (const auto& object : objects)
+		object->commit();
+	prims.build(objects);
+	bvh.build(prims);
+	bounds = bvh.nodes.empty() ? aabb_t::empty() : bvh.nodes[0].bounds;
+	built = true;
+}
+
+void instance_t::init()
+{
+	// the group is shared, only the first instance added to the scene pays for its hierarchy
+	if (!group->built) group->build();
+	// the inverse of a rotation is its transpose, whose rows are the rotated axes
+	to_group[0] = vec3_t{ 1.0f, 0.0f, 0.0f } * rotation;
+	to_group[1] = vec3_t{ 0.0f, 1.0f, 0.0f } * rotation;
+	to_group[2] = vec3_t{ 0.0f, 0.0f, 1.0f } * rotation;
+}
+
+const char* instance_t::validate() const
+{
+	// material and color come from the group objects, the ones of the instance are not used
+	if (group == nullptr) return "instance has no group";
+	if (!isfinite(position.x) || !isfinite(position.y) || !isfinite(position.z)) return "position is not finite";
+	// a scaled quaternion would scale the group, and distances would no longer be the same in both spaces
+	float length_sq = rotation.x * rotation.x + rotation.y * rotation.y + rotation.z * rotation.z + rotation.w * rotation.w;
+	if (!(fabsf(length_sq - 1.0f) < 1e-4f)) return "rotation is not a unit quaternion";
+	return nullptr;
+}
+
+// rotation and translation keep lengths, so distances are the same in both spaces; the rotation is applied as a
+// matrix, cheaper per ray than the quaternion
+ray_t instance_t::to_group_space(const ray_t& ray) const
+{
+	vec3_t origin = ray.origin - position;
+	return { { dot(to_group[0], origin), dot(to_group[1], origin), dot(to_group[2], origin) },
+		{ dot(to_group[0], ray.direction), dot(to_group[1], ray.direction), dot(to_group[2], ray.direction) } };
+}
+
+float instance_t::intersect(const ray_t& ray) const
+{
+	uint32_t prim;
+	float distance = group->bvh.intersect(group->prims, to_group_space(ray), &prim);
+	if (!same_ray(ray, t_last_hit.ray)) t_last_hit = { nullptr, ray, INFINITY, PRIM_NONE };
+	if (distance < t_last_hit.distance) t_last_hit = { this, ray, distance, prim };
+	return distance;
+}
+
+bool instance_t::occluded(const ray_t& ray, float tmax) const
+{
+	return group->bvh.occluded(group->prims, to_group_space(ray), tmax, nullptr);
+}
+
+void instance_t::get_surface(const ray_t& ray, float distance, surface_t* surface) const
+{
+	// intersect() only reports the distance, the group object comes from its last hit or from tracing the group again
+	ray_t group_ray = to_group_space(ray);
+	uint32_t prim = t_last_hit.prim;
+	float group_distance = distance;
+	if (t_last_hit.instance != this || t_last_hit.distance != distance || !same_ray(ray, t_last_hit.ray))
+	{
+		group_distance = group->bvh.intersect(group->prims, group_ray, &prim);
+		assert(group_distance < INFINITY);
+	}
+
+	group->prims.objects[prim]->get_surface(group_ray, group_distance, surface);
+	surface->point = ray.origin + ray.direction * distance;
+	surface->normal = surface->normal * rotation;
+}
+
+aabb_t instance_t::get_bounds() const
+{
+	aabb_t bounds = aabb_t::empty();
+	if (group->bounds.is_empty()) return bounds;
+
+	for (int corner = 0; corner < 8; corner++)
+	{
+		vec3_t point =
+		{
+			corner & 1 ? group->bounds.max.x : group->bounds.min.x,
+			corner & 2 ? group->bounds.max.y : group->bounds.min.y,
+			corner & 4 ? group->bounds.max.z : group->bounds.min.z,
+		};
+		bounds.grow(point * rotation + position);
+	}
+	return bounds;
+}
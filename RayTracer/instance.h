@@ -0,0 +1,34 @@
+#pragma once
+
+#include "bvh.h"
+
+// bottom level group of objects shared by any number of instances, built once in its own space
+struct group_t
+{
+	std::vector<std::unique_ptr<object_t>> objects;
+	prim_set_t prims;
+	bvh_t bvh;
+	aabb_t bounds = aabb_t::empty();
+	bool built = false;
+
+	void add_object(std::unique_ptr<object_t> object);
+	void build();
+};
+
+// places a group in the scene, rays are moved into group space during traversal;
+// position (from object_t) is the translation, material and color come from the group objects
+struct instance_t : public object_t
+{
+	std::shared_ptr<group_t> group;
+	quat_t rotation = quat_t(1.0f, 0.0f, 0.0f, 0.0f);
+	vec3_t to_group[3]; // rows of the inverse rotation, baked by init()
+
+	void init();
+	const char* validate() const;
+	float intersect(const ray_t& ray) const;
+	bool occluded(const ray_t& ray, float tmax) const;
+	aabb_t get_bounds() const;
+	void get_surface(const ray_t& ray, float distance, surface_t* surface) const;
+
+	ray_t to_group_space(const ray_t& ray) const;
+};
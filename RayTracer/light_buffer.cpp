@@ -0,0 +1,137 @@
+#include "light_buffer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const uint32_t LIGHT_BUFFER_MIN_RES = 8, LIGHT_BUFFER_MAX_RES = 256;
+static const float LIGHT_BUFFER_PADDING = 0.001f; // in face coordinates, covers rounding differences with the shadow rays
+
+// faces are numbered 2 * axis + (negative ? 1 : 0); u and v are the other two axes
+static const int face_u[3] = { 1, 2, 0 }, face_v[3] = { 2, 0, 1 };
+
+void light_buffer_t::clear()
+{
+	res = 0;
+	cell_starts.clear();
+	candidates.clear();
+}
+
+void light_buffer_t::build(const prim_set_t& prims, const vec3_t& light_pos)
+{
+	this->light_pos = light_pos;
+	// about one object per cell if every object covered a single one
+	res = (uint32_t)clamp(sqrtf(prims.size() / 6.0f), (float)LIGHT_BUFFER_MIN_RES, (float)LIGHT_BUFFER_MAX_RES);
+	uint32_t cell_count = 6 * res * res;
+
+	// cell ranges of every object on every face, found by projecting its bounds from the light
+	struct footprint_t { uint32_t prim, face, u0, v0, u1, v1; };
+	vector<footprint_t> footprints;
+	for (uint32_t prim = 0; prim < prims.size(); prim++)
+	{
+		aabb_t box = prims.bounds[prim];
+		vec3_t lo = box.min - light_pos, hi = box.max - light_pos;
+		if (lo.x <= 0.0f && lo.y <= 0.0f && lo.z <= 0.0f && hi.x >= 0.0f && hi.y >= 0.0f && hi.z >= 0.0f)
+		{
+			// the light is inside the bounds, the object can be anywhere around it
+			for (uint32_t face = 0; face < 6; face++)
+				footprints.push_back({ prim, face, 0, 0, res - 1, res - 1 });
+			continue;
+		}
+
+		for (uint32_t face = 0; face < 6; face++)
+		{
+			int axis = face / 2, u = face_u[axis], v = face_v[axis];
+			// distance range of the box along the face direction, and the closest it gets to the face axis in u and v
+			float near_a = face & 1 ? -hi[axis] : lo[axis], far_a = face & 1 ? -lo[axis] : hi[axis];
+			float axis_distance = maxf(maxf(lo[u], -hi[u]), maxf(lo[v], -hi[v]));
+			// points seen through a face are at least as far along its axis as they are from it
+			near_a = maxf(near_a, axis_distance * (1.0f - LIGHT_BUFFER_PADDING));
+			if (far_a <= 0.0f || near_a > far_a) continue;
+
+			float coords[2][2]; // [u or v][min or max] in -1..1
+			const int axes[2] = { u, v };
+			for (int i = 0; i < 2; i++)
+			{
+				float c0 = lo[axes[i]], c1 = hi[axes[i]];
+				if (near_a <= 0.0f)
+				{
+					coords[i][0] = -1.0f;
+					coords[i][1] = 1.0f;
+					continue;
+				}
+				// the projection c / a is monotonic in both, so the extremes are at the corners
+				float p0 = c0 / near_a, p1 = c0 / far_a, p2 = c1 / near_a, p3 = c1 / far_a;
+				coords[i][0] = minf(minf(p0, p1), minf(p2, p3)) - LIGHT_BUFFER_PADDING;
+				coords[i][1] = maxf(maxf(p0, p1), maxf(p2, p3)) + LIGHT_BUFFER_PADDING;
+			}
+			if (coords[0][0] > 1.0f || coords[0][1] < -1.0f || coords[1][0] > 1.0f || coords[1][1] < -1.0f) continue;
+
+			auto to_cell = [&](float c) { return (uint32_t)clamp((c + 1.0f) * 0.5f * res, 0.0f, (float)(res - 1)); };
+			footprints.push_back({ prim, face, to_cell(coords[0][0]), to_cell(coords[1][0]), to_cell(coords[0][1]), to_cell(coords[1][1]) });
+		}
+	}
+
+	// fill the cells in two passes, like the grid
+	cell_starts.assign(cell_count + 1, 0);
+	for (const auto& footprint : footprints)
+		for (uint32_t v = footprint.v0; v <= footprint.v1; v++)
+			for (uint32_t u = footprint.u0; u <= footprint.u1; u++)
+				cell_starts[cell_index(footprint.face, u, v) + 1]++;
+	for (uint32_t cell = 0; cell < cell_count; cell++)
+		cell_starts[cell + 1] += cell_starts[cell];
+
+	candidates.resize(cell_starts[cell_count]);
+	vector<uint32_t> cell_fill(cell_starts.begin(), cell_starts.end() - 1);
+	for (const auto& footprint : footprints)
+	{
+		const aabb_t& box = prims.bounds[footprint.prim];
+		vec3_t outside =
+		{
+			maxf(maxf(box.min.x - light_pos.x, light_pos.x - box.max.x), 0.0f),
+			maxf(maxf(box.min.y - light_pos.y, light_pos.y - box.max.y), 0.0f),
+			maxf(maxf(box.min.z - light_pos.z, light_pos.z - box.max.z), 0.0f),
+		};
+		float distance = outside.length();
+		for (uint32_t v = footprint.v0; v <= footprint.v1; v++)
+			for (uint32_t u = footprint.u0; u <= footprint.u1; u++)
+				candidates[cell_fill[cell_index(footprint.face, u, v)]++] = { footprint.prim, distance };
+	}
+
+	// nearest first, so a cell can be left as soon as the candidates are farther than the shadow ray origin
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int cell = 0; cell < (int)cell_count; cell++)
+	{
+		sort(candidates.begin() + cell_starts[cell], candidates.begin() + cell_starts[cell + 1],
+			[](const candidate_t& a, const candidate_t& b) { return a.distance < b.distance; });
+	}
+}
+
+bool light_buffer_t::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	// the shadow ray leaves the light in the direction of its origin
+	vec3_t dir = ray.origin - light_pos;
+	vec3_t abs_dir = { fabsf(dir.x), fabsf(dir.y), fabsf(dir.z) };
+	int axis = abs_dir.x >= abs_dir.y ? (abs_dir.x >= abs_dir.z ? 0 : 2) : (abs_dir.y >= abs_dir.z ? 1 : 2);
+	if (abs_dir[axis] == 0.0f) return false; // origin at the light
+
+	uint32_t face = 2 * axis + (dir[axis] < 0.0f ? 1 : 0);
+	float inv_a = 1.0f / abs_dir[axis];
+	float u = dir[face_u[axis]] * inv_a, v = dir[face_v[axis]] * inv_a;
+	uint32_t cell_u = (uint32_t)clamp((u + 1.0f) * 0.5f * res, 0.0f, (float)(res - 1));
+	uint32_t cell_v = (uint32_t)clamp((v + 1.0f) * 0.5f * res, 0.0f, (float)(res - 1));
+	uint32_t cell = cell_index(face, cell_u, cell_v);
+
+	for (uint32_t i = cell_starts[cell]; i < cell_starts[cell + 1]; i++)
+	{
+		const candidate_t& candidate = candidates[i];
+		if (candidate.distance >= tmax) break; // this and the following objects are beyond the ray origin
+
+		if (prims.objects[candidate.prim] != ignore && prims.occluded(candidate.prim, ray, tmax))
+		{
+			*occluder = candidate.prim;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "accel.h"
+
+#include <vector>
+
+// direction cube around the point light, each cell lists the objects that can block rays leaving the light
+// through it; shadow rays only test the candidates of their cell
+struct light_buffer_t
+{
+	struct candidate_t
+	{
+		uint32_t prim;
+		float distance; // from the light to the object bounds, candidates are sorted by it
+	};
+
+	vec3_t light_pos;
+	uint32_t res; // cells per face side
+	std::vector<uint32_t> cell_starts; // cell i lists candidates[cell_starts[i]..cell_starts[i + 1]]
+	std::vector<candidate_t> candidates;
+
+	void build(const prim_set_t& prims, const vec3_t& light_pos);
+	void clear();
+
+	// the ray must end at the light, tmax being the distance to it
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const;
+
+	bool empty() const { return cell_starts.empty(); }
+	uint32_t cell_index(uint32_t face, uint32_t u, uint32_t v) const { return (face * res + v) * res + u; }
+};
@@ -1,12 +1,99 @@
 #include "ray_tracer.h"
+#include "instance.h"
 
 #include <chrono>
 #include <iostream>
+#include <string.h>
 
 using namespace std;
 
-int main()
+// index of the name among count names, see name_of(); prints the valid names and exits when none matches
+template<typename name_of_t>
+static int parse_name(const char* option, const char* name, int count, name_of_t name_of)
+{
+	for (int i = 0; i < count; i++)
+		if (strcmp(name, name_of(i)) == 0) return i;
+
+	printf("Unknown %s name '%s', expected one of:", option, name);
+	for (int i = 0; i < count; i++)
+		printf(" %s", name_of(i));
+	printf("\n");
+	exit(1);
+}
+
+int main(int argc, char** argv)
 {	
+	bool benchmark = false, memory_report = false, cache_report = false, thread_stats = false;
+	renderer_options_t renderer_options;
+	uint32_t repeat = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		// --accel <name> selects the acceleration structure, see accel_name()
+		if (strcmp(argv[i], "--accel") == 0 && i + 1 < argc)
+			scene_set_accel((accel_t)parse_name("--accel", argv[++i], ACCEL_COUNT, [](int accel) { return accel_name((accel_t)accel); }));
+		// --no-shadows lights every hit without tracing shadow rays
+		if (strcmp(argv[i], "--no-shadows") == 0)
+			scene_set_shadows(false);
+		// --no-light-buffer sends shadow rays through the acceleration structure
+		if (strcmp(argv[i], "--no-light-buffer") == 0)
+			scene_set_light_buffer(false);
+		// --no-screen-tiles sends primary rays through the acceleration structure
+		if (strcmp(argv[i], "--no-screen-tiles") == 0)
+			scene_set_screen_tiles(false);
+		// --layout <name> selects the node order of the binary BVH, see bvh_layout_name()
+		if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+			scene_set_bvh_layout((bvh_layout_t)parse_name("--layout", argv[++i], BVH_LAYOUT_COUNT, [](int layout) { return bvh_layout_name((bvh_layout_t)layout); }));
+		if (strcmp(argv[i], "--prefetch") == 0)
+			scene_set_prefetch(true);
+		// --tile-size <pixels> sets the side of the tiles the threads take work in
+		if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc)
+			scene_set_tile_size((uint32_t)atoi(argv[++i]));
+		// --threads <count> sets the number of render threads, one per core by default
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			int threads = atoi(argv[++i]);
+			if (threads < 1 || threads > (int)thread_pool_t::MAX_THREADS)
+			{
+				printf("Invalid --threads count '%s', expected 1 to %u\n", argv[i], thread_pool_t::MAX_THREADS);
+				exit(1);
+			}
+			renderer_options.threads = (uint32_t)threads;
+		}
+		// --pin keeps each render thread on its own core
+		if (strcmp(argv[i], "--pin") == 0)
+			renderer_options.pin_threads = true;
+		// --priority <name> sets the priority of the render threads, see pool_priority_name()
+		if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc)
+			renderer_options.priority = (pool_priority_t)parse_name("--priority", argv[++i], POOL_PRIORITY_COUNT, [](int priority) { return pool_priority_name((pool_priority_t)priority); });
+		// --repeat <count> renders the image count more times with the same threads and prints the average time
+		if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = (uint32_t)atoi(argv[++i]);
+		// --thread-stats prints the time each thread spent rendering and waiting
+		if (strcmp(argv[i], "--thread-stats") == 0)
+			thread_stats = true;
+		// --packets <size> traces the camera rays of size x size pixel blocks together
+		if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc)
+			scene_set_ray_packets((uint32_t)atoi(argv[++i]));
+		// --wavefront renders the image one bounce at a time
+		if (strcmp(argv[i], "--wavefront") == 0)
+			scene_set_wavefront(true);
+		// --simd <name> caps the instruction set of the batched kernels, see simd_level_name()
+		if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+			scene_set_simd_level((simd_level_t)parse_name("--simd", argv[++i], SIMD_LEVEL_COUNT, [](int level) { return simd_level_name((simd_level_t)level); }));
+		// --spatial-splits <growth> allows the BVH to cut objects, adding up to growth * object count references
+		if (strcmp(argv[i], "--spatial-splits") == 0 && i + 1 < argc)
+			scene_set_spatial_splits((float)atof(argv[++i]));
+		// --cache compares the simulated cache misses of the node layouts
+		if (strcmp(argv[i], "--cache") == 0)
+			cache_report = true;
+		// --memory compares the memory used by the hierarchy layouts
+		if (strcmp(argv[i], "--memory") == 0)
+			memory_report = true;
+		// --benchmark renders with every acceleration structure and reports their speed
+		if (strcmp(argv[i], "--benchmark") == 0)
+			benchmark = true;
+	}
+
 	camera_t camera;
 	camera.pos = { -0.5f, 2.5f, -4.0f };
 	scene_set_camera(camera);
@@ -19,9 +106,9 @@ int main()
 	shared_ptr<image_t> marble_texture(load_png_from_file("marble.png"));
 	shared_ptr<image_t> metal_texture(load_png_from_file("metal.png"));
 
-	material_t glass_simple = { 0.1f, 1.0f, 1.0f, 50.0f, 0.4f, nullptr };
-	material_t glass_metal = { 0.1f, 1.0f, 0.8f, 40.0f, 0.3f, metal_texture };
-	material_t marble = { 0.1f, 0.75f, 0.5f, 50.0f, 0.45f, marble_texture };
+	material_id_t glass_simple = scene_add_material({ 0.1f, 1.0f, 1.0f, 50.0f, 0.4f, nullptr });
+	material_id_t glass_metal = scene_add_material({ 0.1f, 1.0f, 0.8f, 40.0f, 0.3f, metal_texture });
+	material_id_t marble = scene_add_material({ 0.1f, 0.75f, 0.5f, 50.0f, 0.45f, marble_texture });
 
 	{
 		auto sphere = make_unique<sphere_t>();
@@ -94,11 +181,74 @@ int main()
 		scene_add_object(move(plane));
 	}
 
+	{
+		// a pile of small spheres, placed twice by instances sharing its hierarchy
+		auto pile = make_shared<group_t>();
+		const vec3_t positions[] = { { -0.16f, 0.15f, 0.0f }, { 0.16f, 0.15f, 0.0f }, { 0.0f, 0.15f, 0.28f }, { 0.0f, 0.41f, 0.09f } };
+		for (const vec3_t& position : positions)
+		{
+			auto sphere = make_unique<sphere_t>();
+			sphere->material = glass_simple;
+			sphere->position = position;
+			sphere->radius = 0.15f;
+			sphere->color = { 0.9f, 0.8f, 0.2f };
+			pile->add_object(move(sphere));
+		}
+		const vec3_t pile_positions[] = { { 1.9f, -0.5f, 2.3f }, { -1.3f, -0.5f, 0.2f } };
+		const float pile_angles[] = { 30.0f, -45.0f };
+		for (int i = 0; i < 2; i++)
+		{
+			auto instance = make_unique<instance_t>();
+			instance->group = pile;
+			instance->position = pile_positions[i];
+			instance->rotation = quat_t({ 0.0f, 1.0f, 0.0f }, pile_angles[i] * DEG_TO_RAD);
+			scene_add_object(move(instance));
+		}
+	}
+
+	double build_ms = scene_commit();
+
 	image_t output = { SCREEN_WIDTH, SCREEN_HEIGHT, make_unique<pixel_t[]>(SCREEN_WIDTH * SCREEN_HEIGHT) };
+	if (cache_report)
+	{
+		scene_cache_report();
+		return 0;
+	}
+	if (memory_report)
+	{
+		scene_memory_report();
+		return 0;
+	}
+	if (benchmark)
+	{
+		scene_benchmark(&output);
+		return 0;
+	}
+
+	renderer_t renderer(renderer_options);
 	auto begin = chrono::high_resolution_clock::now();
-	scene_render(&output);
+	render_stats_t stats = renderer.render(render_job_t(&output));
 	auto end = chrono::high_resolution_clock::now();
-	cout << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << " ms\n";
+	cout << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << " ms (build " << build_ms + stats.build_ms << " ms, "
+		<< stats.accel_nodes << " nodes, " << simd_level_name(scene_simd_level()) << " kernels, "
+		<< renderer.thread_count() << " threads)\n";
+	if (repeat > 0)
+	{
+		double total_ms = 0.0;
+		for (uint32_t frame = 0; frame < repeat; frame++)
+			total_ms += renderer.render(render_job_t(&output)).render_ms;
+		cout << "repeated renders " << total_ms / repeat << " ms on average\n";
+	}
+	if (stats.occluder_cache_tests > 0)
+		cout << "occluder cache hit rate " << 100.0 * stats.occluder_cache_hits / stats.occluder_cache_tests << "%\n";
+	if (thread_stats)
+	{
+		for (size_t i = 0; i < stats.threads.size(); i++)
+		{
+			const thread_stats_t& thread = stats.threads[i];
+			printf("thread %zu: busy %.1f ms, idle %.1f ms, %u tiles, %u stolen\n", i, thread.busy_ms, thread.idle_ms, thread.tiles, thread.stolen_tiles);
+		}
+	}
 
 	save_png_to_file(output, "scene.png");
 
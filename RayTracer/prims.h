@@ -0,0 +1,129 @@
+#pragma once
+
+#include "ray_tracer.h"
+
+#include <vector>
+
+// intersection kernels shared by the objects and the per type arrays of prim_set_t, so both find the same hits
+
+// ray.dir must be normalized; radius_sq is the squared radius baked by sphere_t::init()
+inline float sphere_intersect(const vec3_t& center, float radius_sq, const ray_t& ray)
+{
+	// https://www.siggraph.org/education/materials/HyperGraph/raytrace/rtinter1.htm
+	float a = (ray.direction * ray.direction).sum();
+	vec3_t os = ray.origin - center;
+	float b = 2.0f * (ray.direction * os).sum();
+	float c = (os * os).sum() - radius_sq;
+	float d = b * b - 4.0f * a * c;
+
+	// if ray can not intersect then stop
+	if (d < 0.0f) return INFINITY;
+
+	// ray can intersect the sphere, solve the closer hitpoint (smaller root)
+	d = sqrtf(d);
+	float t = -0.5f * (b + d) / a;
+	if (t <= 0.0f) return INFINITY; // intersection point behind origin
+	return sqrtf(a) * t;
+}
+
+// ray.dir must be normalized
+inline bool sphere_occluded(const vec3_t& center, float radius_sq, const ray_t& ray, float tmax)
+{
+	// same equation as sphere_intersect() with a == 1 and b halved, only the smaller root counts
+	vec3_t os = ray.origin - center;
+	float b = dot(ray.direction, os);
+	float c = dot(os, os) - radius_sq;
+
+	// origin inside the sphere or sphere behind the origin: the smaller root is not in front of the ray
+	if (c <= 0.0f || b >= 0.0f) return false;
+	float d = b * b - c;
+	if (d < 0.0f) return false;
+
+	// -b - sqrt(d) < tmax, compared without taking the square root
+	float e = -b - tmax;
+	return e < 0.0f || d > e * e;
+}
+
+// frame of a bounded plane with the quad basis baked by plane_t::init()
+struct plane_frame_t
+{
+	vec3_t position, normal;
+	vec3_t u, v;
+};
+
+inline plane_frame_t make_plane_frame(const plane_t& plane)
+{
+	return { plane.position, plane.normal, plane.u, plane.v };
+}
+
+// ray.dir must be normalized
+inline float plane_intersect(const plane_frame_t& plane, const ray_t& ray)
+{
+	// first do standard ray - plane intersection
+	float denom = (ray.direction * plane.normal).sum();
+	if (fabs(denom) < 0.000001f) return INFINITY;
+
+	float distance = ((plane.position - ray.origin) * plane.normal).sum() / denom;
+	if (distance < 0) return INFINITY;
+
+	vec3_t point = ray.origin + ray.direction * distance; // world coordinates
+	// check if point inside bounds by projecting it onto the quad basis
+	point -= plane.position;
+	if (fabs(dot(plane.u, point)) > 1.0f || fabs(dot(plane.v, point)) > 1.0f)
+		return INFINITY;
+
+	return distance;
+}
+
+// ray.dir must be normalized
+inline bool plane_occluded(const plane_frame_t& plane, const ray_t& ray, float tmax)
+{
+	float denom = (ray.direction * plane.normal).sum();
+	if (fabs(denom) < 0.000001f) return false;
+
+	// reject hits past tmax before paying for the bounds check
+	float distance = ((plane.position - ray.origin) * plane.normal).sum() / denom;
+	if (distance < 0 || distance >= tmax) return false;
+
+	vec3_t point = ray.origin + ray.direction * distance - plane.position;
+	return fabs(dot(plane.u, point)) <= 1.0f && fabs(dot(plane.v, point)) <= 1.0f;
+}
+
+// sphere geometry as separate arrays, the layout batched kernels load from
+struct sphere_array_t
+{
+	std::vector<float> x, y, z, radius_sq;
+
+	uint32_t size() const { return (uint32_t)radius_sq.size(); }
+	vec3_t center(uint32_t i) const { return { x[i], y[i], z[i] }; }
+
+	void resize(uint32_t count)
+	{
+		x.resize(count);
+		y.resize(count);
+		z.resize(count);
+		radius_sq.resize(count);
+	}
+
+	void set(uint32_t i, const sphere_t& sphere)
+	{
+		x[i] = sphere.position.x;
+		y[i] = sphere.position.y;
+		z[i] = sphere.position.z;
+		radius_sq[i] = sphere.radius_sq;
+	}
+};
+
+// plane frames, only what intersection needs; color and material index stay in the objects
+struct plane_array_t
+{
+	std::vector<plane_frame_t> frames;
+
+	uint32_t size() const { return (uint32_t)frames.size(); }
+	void resize(uint32_t count) { frames.resize(count); }
+
+	void set(uint32_t i, const plane_t& plane)
+	{
+		frames[i] = make_plane_frame(plane);
+	}
+};
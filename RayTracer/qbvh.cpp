@@ -0,0 +1,220 @@
+#include "qbvh.h"
+#include "simd.h"
+
+#include <float.h>
+
+using namespace std;
+
+static const int QBVH_MAX_Q = 255;
+
+// 2^exponent built from its bits, exponent must be in the normal range -126..127
+static inline float exp2_int(int exponent)
+{
+	uint32_t bits = (uint32_t)(exponent + 127) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// same arithmetic as the traversal: the product is exact, only the addition rounds
+static inline float dequantize(float origin, int q, float scale) { return origin + (float)q * scale; }
+
+template<uint32_t N>
+static void quantize_node(const wbvh_node_t<N>& node, qbvh_node_t<N>& qnode)
+{
+	const float* planes[6] = { node.min_x, node.min_y, node.min_z, node.max_x, node.max_y, node.max_z };
+	uint8_t* qplanes[6] = { qnode.min_x, qnode.min_y, qnode.min_z, qnode.max_x, qnode.max_y, qnode.max_z };
+
+	qnode.valid = 0;
+	for (uint32_t i = 0; i < N; i++)
+	{
+		if (node.child[i] != WBVH_EMPTY) qnode.valid |= 1 << i;
+		if (node.count[i] > 0xFFFF)
+		{
+			printf("Leaf with %u primitives does not fit a quantized node\n", node.count[i]);
+			abort(); // the project is built without exception handling
+		}
+		qnode.child[i] = node.child[i];
+		qnode.count[i] = (uint16_t)node.count[i];
+	}
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float* mins = planes[axis];
+		const float* maxs = planes[axis + 3];
+		float frame_min = INFINITY, frame_max = -INFINITY;
+		for (uint32_t i = 0; i < N; i++)
+		{
+			if ((qnode.valid & (1 << i)) == 0) continue;
+			frame_min = minf(frame_min, mins[i]);
+			frame_max = maxf(frame_max, maxs[i]);
+		}
+
+		// smallest power of two step that lets QBVH_MAX_Q steps cover the frame
+		float origin = frame_min;
+		int exponent;
+		frexpf(maxf((frame_max - origin) / QBVH_MAX_Q, FLT_MIN), &exponent);
+		exponent = max(exponent, -126);
+		while (exponent < 127 && dequantize(origin, QBVH_MAX_Q, exp2_int(exponent)) < frame_max)
+			exponent++;
+		float scale = exp2_int(exponent);
+		qnode.origin[axis] = origin;
+		qnode.exponent[axis] = (int8_t)exponent;
+
+		// round outwards, then fix the steps that rounding in the division or the addition pushed inwards
+		for (uint32_t i = 0; i < N; i++)
+		{
+			if ((qnode.valid & (1 << i)) == 0)
+			{
+				qplanes[axis][i] = qplanes[axis + 3][i] = 0;
+				continue;
+			}
+
+			int q_min = (int)clamp(floorf((mins[i] - origin) / scale), 0.0f, (float)QBVH_MAX_Q);
+			while (q_min > 0 && dequantize(origin, q_min, scale) > mins[i]) q_min--;
+			int q_max = (int)clamp(ceilf((maxs[i] - origin) / scale), 0.0f, (float)QBVH_MAX_Q);
+			while (q_max < QBVH_MAX_Q && dequantize(origin, q_max, scale) < maxs[i]) q_max++;
+			qplanes[axis][i] = (uint8_t)q_min;
+			qplanes[axis + 3][i] = (uint8_t)q_max;
+		}
+	}
+}
+
+// like wbvh_ray_t, but the planes are dequantized from the node frame before the slab test
+template<uint32_t N>
+struct qbvh_ray_t
+{
+	simd_float_t<N> origin[3], inv_dir[3];
+	uint32_t near_offset[3], far_offset[3]; // offsets of the near and far plane arrays from qbvh_node_t::min_x
+
+	explicit qbvh_ray_t(const ray_t& ray)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float inv_dir_axis = 1.0f / ray.direction[axis];
+			origin[axis] = simd_float_t<N>::set1(ray.origin[axis]);
+			inv_dir[axis] = simd_float_t<N>::set1(inv_dir_axis);
+			near_offset[axis] = (inv_dir_axis >= 0.0f ? axis : axis + 3) * N;
+			far_offset[axis] = (inv_dir_axis >= 0.0f ? axis + 3 : axis) * N;
+		}
+	}
+
+	uint32_t hit(const qbvh_node_t<N>& node, float tmax, float* entries) const
+	{
+		typedef simd_float_t<N> simd_t;
+		const uint8_t* planes = node.min_x;
+		simd_t tnear = simd_t::set1(0.0f), tfar = simd_t::set1(tmax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			simd_t frame_origin = simd_t::set1(node.origin[axis]);
+			simd_t scale = simd_t::set1(exp2_int(node.exponent[axis]));
+			simd_t near_plane = frame_origin + simd_t::load_u8(planes + near_offset[axis]) * scale;
+			simd_t far_plane = frame_origin + simd_t::load_u8(planes + far_offset[axis]) * scale;
+			tnear = max(tnear, (near_plane - origin[axis]) * inv_dir[axis]);
+			tfar = min(tfar, (far_plane - origin[axis]) * inv_dir[axis]);
+		}
+		tnear.store(entries);
+		return less_equal_mask(tnear, tfar) & node.valid;
+	}
+};
+
+template<uint32_t N>
+void qbvh_t<N>::build(const wbvh_t<N>& wbvh)
+{
+	simd_level = wbvh.simd_level;
+	prim_ids = wbvh.prim_ids;
+	nodes.resize(wbvh.nodes.size());
+	#pragma omp parallel for if(wbvh.nodes.size() > 4096)
+	for (int i = 0; i < (int)wbvh.nodes.size(); i++)
+		quantize_node(wbvh.nodes[i], nodes[i]);
+}
+
+// the node test of QBVH8 in one AVX register whatever the project targets, with the same operations as qbvh_ray_t
+// so that both find the same hits
+struct qbvh8_ray_avx_t
+{
+	__m256 origin[3], inv_dir[3];
+	uint32_t near_offset[3], far_offset[3];
+
+	SIMD_TARGET("avx")
+	explicit qbvh8_ray_avx_t(const ray_t& ray)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float inv_dir_axis = 1.0f / ray.direction[axis];
+			origin[axis] = _mm256_set1_ps(ray.origin[axis]);
+			inv_dir[axis] = _mm256_set1_ps(inv_dir_axis);
+			near_offset[axis] = (inv_dir_axis >= 0.0f ? axis : axis + 3) * 8;
+			far_offset[axis] = (inv_dir_axis >= 0.0f ? axis + 3 : axis) * 8;
+		}
+	}
+
+	// widening bytes to 8 ints needs AVX2, so each half is widened with SSE2
+	SIMD_TARGET("avx")
+	static __m256 load_u8(const uint8_t* p)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+		__m256i ints = _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(words, zero)), _mm_unpackhi_epi16(words, zero), 1);
+		return _mm256_cvtepi32_ps(ints);
+	}
+
+	SIMD_TARGET("avx")
+	uint32_t hit(const qbvh_node_t<8>& node, float tmax, float* entries) const
+	{
+		const uint8_t* planes = node.min_x;
+		__m256 tnear = _mm256_setzero_ps(), tfar = _mm256_set1_ps(tmax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m256 frame_origin = _mm256_set1_ps(node.origin[axis]);
+			__m256 scale = _mm256_set1_ps(exp2_int(node.exponent[axis]));
+			__m256 near_plane = _mm256_add_ps(frame_origin, _mm256_mul_ps(load_u8(planes + near_offset[axis]), scale));
+			__m256 far_plane = _mm256_add_ps(frame_origin, _mm256_mul_ps(load_u8(planes + far_offset[axis]), scale));
+			tnear = _mm256_max_ps(tnear, _mm256_mul_ps(_mm256_sub_ps(near_plane, origin[axis]), inv_dir[axis]));
+			tfar = _mm256_min_ps(tfar, _mm256_mul_ps(_mm256_sub_ps(far_plane, origin[axis]), inv_dir[axis]));
+		}
+		_mm256_store_ps(entries, tnear);
+		return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ)) & node.valid;
+	}
+};
+
+SIMD_TARGET("avx")
+static float qbvh8_intersect_avx(const qbvh8_t& qbvh8, const prim_set_t& prims, const ray_t& ray, uint32_t* prim)
+{
+	return wbvh_intersect<8, qbvh8_ray_avx_t>(qbvh8, prims, ray, prim);
+}
+
+SIMD_TARGET("avx")
+static bool qbvh8_occluded_avx(const qbvh8_t& qbvh8, const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder)
+{
+	return wbvh_occluded<8, qbvh8_ray_avx_t>(qbvh8, prims, ray, tmax, ignore, occluder);
+}
+
+template<uint32_t N>
+float qbvh_t<N>::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	return wbvh_intersect<N, qbvh_ray_t<N>>(*this, prims, ray, prim);
+}
+
+template<uint32_t N>
+bool qbvh_t<N>::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	return wbvh_occluded<N, qbvh_ray_t<N>>(*this, prims, ray, tmax, ignore, occluder);
+}
+
+template<>
+float qbvh_t<8>::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	if (simd_level >= SIMD_AVX) return qbvh8_intersect_avx(*this, prims, ray, prim);
+	return wbvh_intersect<8, qbvh_ray_t<8>>(*this, prims, ray, prim);
+}
+
+template<>
+bool qbvh_t<8>::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	if (simd_level >= SIMD_AVX) return qbvh8_occluded_avx(*this, prims, ray, tmax, ignore, occluder);
+	return wbvh_occluded<8, qbvh_ray_t<8>>(*this, prims, ray, tmax, ignore, occluder);
+}
+
+template struct qbvh_t<4>;
+template struct qbvh_t<8>;
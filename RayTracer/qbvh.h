@@ -0,0 +1,35 @@
+#pragma once
+
+#include "wbvh.h"
+
+// wide BVH node with child boxes quantized to 8 bits in the frame of the node: a plane is origin + q * 2^exponent,
+// which is exact up to the final addition, so boxes are rounded outwards once at build time and stay conservative;
+// the 4 wide node fits in one cache line instead of two
+template<uint32_t N>
+struct alignas(64) qbvh_node_t
+{
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t valid; // bit per occupied child slot
+	uint8_t min_x[N], min_y[N], min_z[N];
+	uint8_t max_x[N], max_y[N], max_z[N];
+	uint32_t child[N]; // interior child: node index, leaf child: first entry in prim_ids
+	uint16_t count[N]; // number of primitives for leaf children, 0 for interior children
+};
+
+// wide BVH with quantized nodes, quantized from the float wide BVH it mirrors node for node
+template<uint32_t N>
+struct qbvh_t
+{
+	std::vector<qbvh_node_t<N>, aligned_allocator_t<qbvh_node_t<N>, 64>> nodes; // root is node 0
+	std::vector<uint32_t> prim_ids;
+	simd_level_t simd_level = SIMD_SSE42; // of the traversal, taken from the wide BVH like the rest of the tree
+
+	void build(const wbvh_t<N>& wbvh);
+
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const;
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder = nullptr) const;
+};
+
+typedef qbvh_t<4> qbvh4_t;
+typedef qbvh_t<8> qbvh8_t;
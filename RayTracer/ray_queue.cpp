@@ -0,0 +1,75 @@
+#include "ray_queue.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const uint32_t MORTON_BITS = 10; // per axis
+
+void ray_queue_t::clear()
+{
+	origin_x.clear(); origin_y.clear(); origin_z.clear();
+	dir_x.clear(); dir_y.clear(); dir_z.clear();
+	weight.clear();
+	pixel.clear();
+}
+
+void ray_queue_t::push(const ray_t& ray, float weight, uint32_t pixel)
+{
+	origin_x.push_back(ray.origin.x); origin_y.push_back(ray.origin.y); origin_z.push_back(ray.origin.z);
+	dir_x.push_back(ray.direction.x); dir_y.push_back(ray.direction.y); dir_z.push_back(ray.direction.z);
+	this->weight.push_back(weight);
+	this->pixel.push_back(pixel);
+}
+
+// spreads the low 10 bits of v so that there are two zero bits between each of them
+static uint32_t morton_spread(uint32_t v)
+{
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v << 8)) & 0x0300F00F;
+	v = (v | (v << 4)) & 0x030C30C3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+void ray_queue_t::sort(const aabb_t& bounds)
+{
+	const float cells = (float)((1 << MORTON_BITS) - 1);
+	vec3_t extent = bounds.extent();
+	vec3_t scale = { extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f, extent.z > 0.0f ? cells / extent.z : 0.0f };
+
+	keys.resize(size());
+	for (uint32_t i = 0; i < size(); i++)
+	{
+		uint32_t octant = (dir_x[i] < 0.0f ? 1 : 0) | (dir_y[i] < 0.0f ? 2 : 0) | (dir_z[i] < 0.0f ? 4 : 0);
+		// origins outside the bounds, like the camera, are clamped to its faces
+		uint32_t x = (uint32_t)clamp((origin_x[i] - bounds.min.x) * scale.x, 0.0f, cells);
+		uint32_t y = (uint32_t)clamp((origin_y[i] - bounds.min.y) * scale.y, 0.0f, cells);
+		uint32_t z = (uint32_t)clamp((origin_z[i] - bounds.min.z) * scale.z, 0.0f, cells);
+		uint32_t morton = morton_spread(x) | (morton_spread(y) << 1) | (morton_spread(z) << 2);
+		keys[i] = { ((uint64_t)octant << (3 * MORTON_BITS)) | morton, i };
+	}
+	// ties keep their order, which keeps the result independent of the sort implementation
+	std::sort(keys.begin(), keys.end(), [](const key_t& a, const key_t& b) { return a.key < b.key || (a.key == b.key && a.index < b.index); });
+
+	permute(origin_x); permute(origin_y); permute(origin_z);
+	permute(dir_x); permute(dir_y); permute(dir_z);
+	permute(weight);
+	permute(pixel);
+}
+
+void ray_queue_t::permute(vector<float>& values)
+{
+	float_scratch.resize(values.size());
+	for (size_t i = 0; i < keys.size(); i++)
+		float_scratch[i] = values[keys[i].index];
+	values.swap(float_scratch);
+}
+
+void ray_queue_t::permute(vector<uint32_t>& values)
+{
+	index_scratch.resize(values.size());
+	for (size_t i = 0; i < keys.size(); i++)
+		index_scratch[i] = values[keys[i].index];
+	values.swap(index_scratch);
+}
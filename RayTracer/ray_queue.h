@@ -0,0 +1,34 @@
+#pragma once
+
+#include "ray_tracer.h"
+
+#include <vector>
+
+// rays of one stage of the wavefront renderer, stored per component; every ray carries the pixel it contributes to
+// and the weight of its contribution, the product of the reflection coefficients along its path
+struct ray_queue_t
+{
+	std::vector<float> origin_x, origin_y, origin_z;
+	std::vector<float> dir_x, dir_y, dir_z;
+	std::vector<float> weight;
+	std::vector<uint32_t> pixel;
+
+	uint32_t size() const { return (uint32_t)pixel.size(); }
+	ray_t ray(uint32_t index) const { return { { origin_x[index], origin_y[index], origin_z[index] }, { dir_x[index], dir_y[index], dir_z[index] } }; }
+
+	void clear();
+	void push(const ray_t& ray, float weight, uint32_t pixel);
+
+	// reorders the rays by direction octant, then by origin along a Morton curve through the bounds, so that
+	// consecutive rays start close to each other and traverse the same parts of the scene
+	void sort(const aabb_t& bounds);
+
+private:
+	struct key_t { uint64_t key; uint32_t index; };
+	std::vector<key_t> keys;
+	std::vector<float> float_scratch;
+	std::vector<uint32_t> index_scratch;
+
+	void permute(std::vector<float>& values);
+	void permute(std::vector<uint32_t>& values);
+};
@@ -1,6 +1,19 @@
 #include "ray_tracer.h"
+#include "bvh.h"
+#include "wbvh.h"
+#include "qbvh.h"
+#include "grid.h"
+#include "light_buffer.h"
+#include "screen_tiles.h"
+#include "ray_queue.h"
+#include "vec8.h"
+#include "cache_sim.h"
+#include "tile_scheduler.h"
 
+#include <algorithm>
 #include <chrono>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -12,55 +25,280 @@ struct
 	light_t light;
 	camera_t camera;
 	vector<unique_ptr<object_t>> objects;
+	vector<material_t> materials; // indexed by object_t::material
+	accel_t accel = ACCEL_BVH;
+	bool committed = false; // objects are validated and baked, no more can be added
+	bool built = false; // acceleration structures are up to date with the objects
+	prim_set_t prims;
+	bvh_layout_t bvh_layout = BVH_LAYOUT_TREELET;
+	bool prefetch = false;
+	float spatial_split_growth = 0.0f; // reference budget of spatial splits, 0 disables them
+	simd_level_t simd_level = SIMD_AVX512;
+	uint32_t packet_size = 0; // pixels per side of the camera ray packets, 0 traces every ray alone
+	uint32_t tile_size = 32; // pixels per side of the scheduled tiles when rays are traced alone
+	bool wavefront = false;
+	bvh_t bvh;
+	bvh4_t bvh4;
+	bvh8_t bvh8;
+	qbvh4_t qbvh4;
+	qbvh8_t qbvh8;
+	lazy_bvh_t lazy_bvh;
+	grid_t grid;
+	bool shadows = true;
+	bool use_light_buffer = true;
+	light_buffer_t light_buffer; // shadow ray candidates, replaces the acceleration structure for shadow rays
+	bool use_screen_tiles = true;
+	screen_tiles_t screen_tiles; // primary ray candidates, replaces the acceleration structure for primary rays
 } g_scene;
 
-void scene_set_light(const light_t& light) { g_scene.light = light; }
-void scene_set_camera(const camera_t& camera) { g_scene.camera = camera; }
+const char* accel_name(accel_t accel)
+{
+	static const char* names[ACCEL_COUNT] = { "brute-force", "bvh", "bvh4", "bvh8", "qbvh4", "qbvh8", "lazy-bvh", "grid" };
+	return accel < ACCEL_COUNT ? names[accel] : "unknown";
+}
+
+const char* bvh_layout_name(bvh_layout_t layout)
+{
+	static const char* names[BVH_LAYOUT_COUNT] = { "build", "treelet" };
+	return layout < BVH_LAYOUT_COUNT ? names[layout] : "unknown";
+}
+
+void scene_set_light(const light_t& light) { g_scene.light = light; g_scene.built = false; }
+void scene_set_camera(const camera_t& camera) { g_scene.camera = camera; g_scene.built = false; }
+void scene_set_accel(accel_t accel) { g_scene.accel = accel; g_scene.built = false; }
+void scene_set_shadows(bool enabled) { g_scene.shadows = enabled; g_scene.built = false; }
+void scene_set_light_buffer(bool enabled) { g_scene.use_light_buffer = enabled; g_scene.built = false; }
+void scene_set_screen_tiles(bool enabled) { g_scene.use_screen_tiles = enabled; g_scene.built = false; }
+void scene_set_bvh_layout(bvh_layout_t layout) { g_scene.bvh_layout = layout; g_scene.built = false; }
+void scene_set_prefetch(bool enabled) { g_scene.prefetch = enabled; g_scene.bvh.prefetch = enabled; }
+void scene_set_spatial_splits(float max_reference_growth) { g_scene.spatial_split_growth = max_reference_growth; g_scene.built = false; }
+void scene_set_simd_level(simd_level_t level) { g_scene.simd_level = level; g_scene.built = false; }
+
+void scene_set_wavefront(bool enabled) { g_scene.wavefront = enabled; }
+
+void scene_set_ray_packets(uint32_t size)
+{
+	if (size * size > ray_packet_t::MAX_SIZE)
+	{
+		printf("Ray packets of %ux%u pixels are too large\n", size, size);
+		abort();
+	}
+	g_scene.packet_size = size;
+	g_scene.built = false;
+}
+
+void scene_set_tile_size(uint32_t size)
+{
+	if (size == 0)
+	{
+		printf("Tiles must be at least one pixel wide\n");
+		abort();
+	}
+	g_scene.tile_size = size;
+}
+
+simd_level_t scene_simd_level()
+{
+	simd_level_t selected;
+	sphere_batch_kernel(g_scene.simd_level, &selected);
+	return selected;
+}
+
+material_id_t scene_add_material(const material_t& material)
+{
+	if (g_scene.committed)
+	{
+		printf("Materials can not be added after scene_commit()\n");
+		abort();
+	}
+	const material_t& m = material;
+	if (!(m.ambient >= 0.0f && m.diffuse_c >= 0.0f && m.specular_c >= 0.0f && m.specular_k >= 0.0f && m.reflection >= 0.0f && m.reflection <= 1.0f))
+	{
+		printf("Invalid material: coefficients must not be negative, and reflection not above 1\n");
+		abort();
+	}
+	if (g_scene.materials.size() >= MATERIAL_NONE)
+	{
+		printf("Too many materials, at most %u are supported\n", (uint32_t)MATERIAL_NONE);
+		abort();
+	}
+	g_scene.materials.push_back(material);
+	return (material_id_t)(g_scene.materials.size() - 1);
+}
+
+const material_t& scene_material(material_id_t id) { return g_scene.materials[id]; }
 
 void scene_add_object(unique_ptr<object_t> object)
 {
-	object->init();
+	if (g_scene.committed)
+	{
+		printf("Objects can not be added after scene_commit()\n");
+		abort();
+	}
 	g_scene.objects.push_back(move(object));
+	g_scene.built = false;
+}
+
+static bool accel_uses_bvh(accel_t accel) { return accel != ACCEL_BRUTE_FORCE && accel != ACCEL_LAZY_BVH && accel != ACCEL_GRID; }
+// only the binary BVH has a packet traversal
+static bool scene_uses_packets() { return g_scene.packet_size > 0 && g_scene.accel == ACCEL_BVH; }
+
+static void scene_build_bvh()
+{
+	if (g_scene.spatial_split_growth > 0.0f) g_scene.bvh.build_spatial(g_scene.prims, g_scene.spatial_split_growth);
+	else g_scene.bvh.build(g_scene.prims);
+	g_scene.bvh.reorder(g_scene.bvh_layout);
+}
+
+// wide and quantized hierarchies are collapsed from the binary one, and only when used
+static void scene_build_wide()
+{
+	accel_t accel = g_scene.accel;
+	g_scene.bvh4.build(accel == ACCEL_BVH4 || accel == ACCEL_QBVH4 ? g_scene.bvh : bvh_t(), g_scene.simd_level);
+	g_scene.bvh8.build(accel == ACCEL_BVH8 || accel == ACCEL_QBVH8 ? g_scene.bvh : bvh_t(), g_scene.simd_level);
+	g_scene.qbvh4.build(accel == ACCEL_QBVH4 ? g_scene.bvh4 : bvh4_t());
+	g_scene.qbvh8.build(accel == ACCEL_QBVH8 ? g_scene.bvh8 : bvh8_t());
+	// the float nodes were only needed to quantize from
+	if (accel == ACCEL_QBVH4) g_scene.bvh4 = bvh4_t();
+	if (accel == ACCEL_QBVH8) g_scene.bvh8 = bvh8_t();
+}
+
+// called once the scene is committed, before rendering starts; only the selected structure is built
+static void scene_build()
+{
+	if (!g_scene.committed)
+	{
+		printf("scene_commit() must be called before rendering\n");
+		abort();
+	}
+	accel_t accel = g_scene.accel;
+	g_scene.prims.build(g_scene.objects);
+	g_scene.prims.sphere_batch.select(g_scene.simd_level);
+	if (accel_uses_bvh(accel)) scene_build_bvh();
+	else g_scene.bvh.build(prim_set_t());
+	g_scene.bvh.prefetch = g_scene.prefetch;
+	scene_build_wide();
+	// the lazy hierarchy keeps reading the primitives, it must not be given a temporary
+	if (accel == ACCEL_LAZY_BVH) g_scene.lazy_bvh.build(g_scene.prims);
+	else g_scene.lazy_bvh.clear();
+	g_scene.grid.build(accel == ACCEL_GRID ? g_scene.prims : prim_set_t());
+	if (g_scene.use_light_buffer && g_scene.shadows) g_scene.light_buffer.build(g_scene.prims, g_scene.light.pos);
+	else g_scene.light_buffer.clear();
+	if (g_scene.use_screen_tiles && !scene_uses_packets()) g_scene.screen_tiles.build(g_scene.prims, g_scene.camera.pos, screen_t::create());
+	else g_scene.screen_tiles.clear();
+	g_scene.built = true;
+}
+
+double scene_commit()
+{
+	for (const auto& object : g_scene.objects)
+		object->commit();
+	g_scene.committed = true;
+	auto begin = chrono::high_resolution_clock::now();
+	scene_build();
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - begin).count();
+}
+
+// SAH cost growth that triggers rebuilding the degraded subtrees, and the whole hierarchy if that is not enough
+static const float SUBTREE_REBUILD_COST_GROWTH = 1.1f;
+static const float FULL_REBUILD_COST_GROWTH = 1.2f;
+
+scene_update_stats_t scene_update()
+{
+	typedef chrono::duration<double, milli> ms_t;
+	scene_update_stats_t stats = {};
+	auto begin = chrono::high_resolution_clock::now();
+	// moved or resized objects are validated and baked again
+	for (const auto& object : g_scene.objects)
+		object->commit();
+
+	// the grid has no refit, it is cheap enough to build again, and the lazy hierarchy only builds its top levels
+	if (!g_scene.built || !accel_uses_bvh(g_scene.accel))
+	{
+		scene_build();
+		stats.rebuild_ms = ms_t(chrono::high_resolution_clock::now() - begin).count();
+		stats.cost_growth = 1.0f;
+		stats.full_rebuild = true;
+		return stats;
+	}
+
+	g_scene.prims.update();
+	g_scene.bvh.refit(g_scene.prims);
+	auto refitted = chrono::high_resolution_clock::now();
+
+	bvh_t& bvh = g_scene.bvh;
+	stats.rebuilt_subtrees = bvh.rebuild_subtrees(g_scene.prims, SUBTREE_REBUILD_COST_GROWTH);
+	stats.cost_growth = bvh.built_cost > 0.0f ? bvh.sah_cost() / bvh.built_cost : 1.0f;
+
+	// the top levels are not covered by subtree rebuilds, and each of those leaves unused nodes behind
+	if (stats.cost_growth > FULL_REBUILD_COST_GROWTH || bvh.unused_nodes > bvh.nodes.size() / 2)
+	{
+		scene_build_bvh();
+		stats.cost_growth = 1.0f;
+		stats.full_rebuild = true;
+	}
+
+	// wide hierarchies are collapsed again from the updated binary one
+	scene_build_wide();
+	if (g_scene.use_light_buffer && g_scene.shadows) g_scene.light_buffer.build(g_scene.prims, g_scene.light.pos);
+	if (g_scene.use_screen_tiles && !scene_uses_packets()) g_scene.screen_tiles.build(g_scene.prims, g_scene.camera.pos, screen_t::create());
+	auto end = chrono::high_resolution_clock::now();
+
+	stats.refit_ms = ms_t(refitted - begin).count();
+	stats.rebuild_ms = ms_t(end - refitted).count();
+	return stats;
 }
 
 struct ray_hit_t
 {
-	const object_t* object;
+	const shape_t* object; // object providing the material, see surface_t
 	vec3_t point, normal;
 	color_t color;
 };
 
-// ray.dir must be normalized
-float sphere_t::intersect(const ray_t& ray) const
+static bool is_finite(const vec3_t& v) { return isfinite(v.x) && isfinite(v.y) && isfinite(v.z); }
+
+const char* object_t::validate() const
 {
-	// https://www.siggraph.org/education/materials/HyperGraph/raytrace/rtinter1.htm
-	float a = (ray.direction * ray.direction).sum();
-	vec3_t os = ray.origin - position;
-	float b = 2.0f * (ray.direction * os).sum();
-	float c = (os * os).sum() - radius * radius;
-	float d = b * b - 4.0f * a * c;
+	if (!is_finite(position)) return "position is not finite";
+	if (material >= g_scene.materials.size()) return "material is not registered with scene_add_material()";
+	return nullptr;
+}
 
-	// if ray can not intersect then stop
-	if (d < 0.0f) return INFINITY;
+void sphere_t::init()
+{
+	radius_sq = radius * radius;
+	inv_radius = 1.0f / radius;
+}
 
-	// ray can intersect the sphere, solve the closer hitpoint (smaller root)
-	d = sqrtf(d);
-	float t = -0.5f * (b + d) / a;
-	if (t <= 0.0f) return INFINITY; // intersection point behind origin
-	return sqrtf(a) * t;
+const char* sphere_t::validate() const
+{
+	if (!(radius > 0.0f && isfinite(radius))) return "sphere radius must be positive";
+	return object_t::validate();
 }
 
+float sphere_t::intersect(const ray_t& ray) const { return sphere_intersect(position, radius_sq, ray); }
+bool sphere_t::occluded(const ray_t& ray, float tmax) const { return sphere_occluded(position, radius_sq, ray, tmax); }
+
 vec3_t sphere_t::get_normal(const vec3_t& point) const
 {
+	// not scaled by inv_radius: hit points are off the surface by rounding, and reflections between small spheres
+	// would amplify the error of the length
 	return (point - position).normalize();
 }
 
+aabb_t sphere_t::get_bounds() const
+{
+	vec3_t extent = { radius, radius, radius };
+	return { position - extent, position + extent };
+}
+
 vec2_t sphere_t::get_tex_coords(const vec3_t& point) const
 {
 	vec3_t rel_point = point - position;
 	// convert relative point into spherical coordinates (-pi..pi and 0..pi) and then into texture coordinates
 	float x = 0.5f * (1.0f + atan2f(rel_point.z, rel_point.x) / PI);
-	float y = acosf(rel_point.y / radius) / PI;
+	float y = acosf(rel_point.y * inv_radius) / PI;
 	return { x, y };
 }
 
@@ -70,81 +308,225 @@ void plane_t::init()
 	quat_t rot(normal, { 0.0f, 0.0f, -1.0f });
 	tg = x_axis * rot;
 	ctg = y_axis * rot;
+	// intersect() and get_tex_coords() project points on the rotated axes, the inverse rotation of the point
+	u = rotate(tg, normal, -angle) * (1.0f / bounds.x);
+	v = rotate(ctg, normal, -angle) * (1.0f / bounds.y);
 }
 
-// ray.dir must be normalized
-float plane_t::intersect(const ray_t& ray) const
+const char* plane_t::validate() const
 {
-	// first do standard ray - plane intersection
-	float denom = (ray.direction * normal).sum();
-	if (fabs(denom) < 0.000001f) return INFINITY;
+	if (!is_finite(normal) || fabsf(normal.length() - 1.0f) > 0.001f) return "plane normal must be normalized";
+	if (!(bounds.x > 0.0f && bounds.y > 0.0f && isfinite(bounds.x) && isfinite(bounds.y))) return "plane bounds must be positive";
+	if (!isfinite(angle)) return "plane angle is not finite";
+	return object_t::validate();
+}
 
-	float distance = ((position - ray.origin) * normal).sum() / denom;
-	if (distance < 0) return INFINITY;
+float plane_t::intersect(const ray_t& ray) const { return plane_intersect(make_plane_frame(*this), ray); }
+bool plane_t::occluded(const ray_t& ray, float tmax) const { return plane_occluded(make_plane_frame(*this), ray, tmax); }
 
-	vec3_t point = ray.origin + ray.direction * distance; // world coordinates
-	// convert point into plane coordinates
-	point -= position;
-	point = rotate(point, normal, angle);
-		
-	// check if point inside bounds by projecting onto tangent and cotangent
-	if (fabs(dot(tg, point)) > bounds.x || fabs(dot(ctg, point)) > bounds.y)
-		return INFINITY;
+vec3_t plane_t::get_normal(const vec3_t&) const { return normal; }
 
-	return distance;
+aabb_t plane_t::get_bounds() const
+{
+	// plane axes in world space (intersect() rotates points by angle before projecting them on tg and ctg)
+	vec3_t u = rotate(tg, normal, -angle);
+	vec3_t v = rotate(ctg, normal, -angle);
+	const float padding = 0.0001f; // keeps the box from being flat
+	vec3_t extent =
+	{
+		fabsf(u.x) * bounds.x + fabsf(v.x) * bounds.y + padding,
+		fabsf(u.y) * bounds.x + fabsf(v.y) * bounds.y + padding,
+		fabsf(u.z) * bounds.x + fabsf(v.z) * bounds.y + padding,
+	};
+	return { position - extent, position + extent };
+}
+
+aabb_t plane_t::get_clipped_bounds(const aabb_t& box) const
+{
+	// clip the quad by each side of the box in turn (Sutherland-Hodgman), every side adds at most one vertex
+	const float padding = 0.0001f; // as in get_bounds(), hits on the clipped part must not be lost to rounding
+	vec3_t u = rotate(tg, normal, -angle) * bounds.x;
+	vec3_t v = rotate(ctg, normal, -angle) * bounds.y;
+	vec3_t polygon[10] = { position - u - v, position + u - v, position + u + v, position - u + v };
+	uint32_t count = 4;
+	for (int side = 0; side < 6 && count > 0; side++)
+	{
+		int axis = side % 3;
+		float limit = side < 3 ? box.min[axis] - padding : box.max[axis] + padding;
+		float sign = side < 3 ? 1.0f : -1.0f; // positive distances are inside
+		vec3_t clipped[10];
+		uint32_t clipped_count = 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const vec3_t& a = polygon[i];
+			const vec3_t& b = polygon[(i + 1) % count];
+			float da = sign * (a[axis] - limit), db = sign * (b[axis] - limit);
+			if (da >= 0.0f) clipped[clipped_count++] = a;
+			if ((da >= 0.0f) != (db >= 0.0f)) clipped[clipped_count++] = a + (b - a) * (da / (da - db));
+		}
+		copy(clipped, clipped + clipped_count, polygon);
+		count = clipped_count;
+	}
+
+	aabb_t result = aabb_t::empty();
+	for (uint32_t i = 0; i < count; i++)
+		result.grow(polygon[i]);
+	if (result.is_empty()) return result;
+	vec3_t extent = { padding, padding, padding };
+	return { result.min - extent, result.max + extent };
 }
 
-vec3_t plane_t::get_normal(const vec3_t&) const { return normal; }
-	
 vec2_t plane_t::get_tex_coords(const vec3_t& point) const
 {
-	// project hit point into plane coordinates
-	vec3_t rel_point = rotate(point - position, normal, angle);
-	// compute texture coordinates by projecting relative hit point on plane tangent and cotangent
-	float x = 0.5f * dot(rel_point, tg) / bounds.x + 0.5f;
-	float y = 0.5f * dot(rel_point, ctg) / bounds.y + 0.5f;
+	// compute texture coordinates by projecting relative hit point on the quad basis
+	vec3_t rel_point = point - position;
+	float x = 0.5f * dot(rel_point, u) + 0.5f;
+	float y = 0.5f * dot(rel_point, v) + 0.5f;
 	return { x, y };
 }
 
-bool trace_ray(const ray_t& ray, ray_hit_t* hit)
+// returns the distance to the closest object hit by the ray (INFINITY if there is none)
+static float scene_intersect(const ray_t& ray, uint32_t* prim)
 {
-	float distance = INFINITY;
+	if (g_scene.accel != ACCEL_BRUTE_FORCE)
+	{
+		float distance;
+		switch (g_scene.accel)
+		{
+		case ACCEL_BVH4: distance = g_scene.bvh4.intersect(g_scene.prims, ray, prim); break;
+		case ACCEL_BVH8: distance = g_scene.bvh8.intersect(g_scene.prims, ray, prim); break;
+		case ACCEL_QBVH4: distance = g_scene.qbvh4.intersect(g_scene.prims, ray, prim); break;
+		case ACCEL_QBVH8: distance = g_scene.qbvh8.intersect(g_scene.prims, ray, prim); break;
+		case ACCEL_LAZY_BVH: distance = g_scene.lazy_bvh.intersect(g_scene.prims, ray, prim); break;
+		case ACCEL_GRID: distance = g_scene.grid.intersect(g_scene.prims, ray, prim); break;
+		default: distance = g_scene.bvh.intersect(g_scene.prims, ray, prim); break;
+		}
+		return distance;
+	}
 
-	for (const auto& object : g_scene.objects)
+	// through the objects rather than the per type arrays, so this also validates those
+	float distance = INFINITY;
+	for (uint32_t i = 0; i < g_scene.prims.size(); i++)
 	{
-		float object_distance = object->intersect(ray);
+		float object_distance = g_scene.prims.objects[i]->intersect(ray);
 		if (object_distance < distance)
 		{
 			distance = object_distance;
-			hit->object = object.get();
+			*prim = i;
 		}
 	}
+	return distance;
+}
 
-	if (distance == INFINITY) return false; // no hits
+// checks if any object other than the ignored one blocks the ray before tmax, and which one does
+static bool scene_occluded(const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder)
+{
+	if (g_scene.accel != ACCEL_BRUTE_FORCE)
+	{
+		bool occluded;
+		switch (g_scene.accel)
+		{
+		case ACCEL_BVH4: occluded = g_scene.bvh4.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		case ACCEL_BVH8: occluded = g_scene.bvh8.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		case ACCEL_QBVH4: occluded = g_scene.qbvh4.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		case ACCEL_QBVH8: occluded = g_scene.qbvh8.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		case ACCEL_LAZY_BVH: occluded = g_scene.lazy_bvh.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		case ACCEL_GRID: occluded = g_scene.grid.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		default: occluded = g_scene.bvh.occluded(g_scene.prims, ray, tmax, ignore, occluder); break;
+		}
+		return occluded;
+	}
 
-	hit->point = ray.origin + ray.direction * distance;
-	hit->normal = hit->object->get_normal(hit->point);
-	
-	bool in_shadow = false;
-	vec3_t light_dir = (g_scene.light.pos - hit->point).normalize();
-	ray_t light_ray = { hit->point + hit->normal * 0.001f, light_dir };
-	for (const auto& object : g_scene.objects)
+	for (uint32_t i = 0; i < g_scene.prims.size(); i++)
 	{
-		if (object.get() != hit->object)
+		const object_t* object = g_scene.prims.objects[i];
+		if (object != ignore && object->occluded(ray, tmax))
 		{
-			if (object->intersect(light_ray) < INFINITY)
-			{
-				in_shadow = true;
-				break;
-			}
+			*occluder = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// state owned by one rendering thread
+struct trace_context_t
+{
+	// neighboring pixels are usually shadowed by the same object, so the last one found is tried first;
+	// there is one per reflection depth since each bounce sees different parts of the scene
+	uint32_t last_occluder[REFLECTIONS]; // primitives, PRIM_NONE until a shadow ray is blocked
+	uint32_t screen_tile; // of the pixel being rendered, used by its primary ray
+	uint32_t worker; // index in the tile scheduler
+	thread_stats_t stats;
+	uint64_t rays;
+	uint64_t occluder_cache_tests, occluder_cache_hits;
+};
+
+static bool trace_shadow_ray(const ray_t& ray, float tmax, const object_t* ignore, uint32_t depth, trace_context_t* context)
+{
+	const prim_set_t& prims = g_scene.prims;
+	uint32_t& last_occluder = context->last_occluder[depth];
+	if (last_occluder != PRIM_NONE && prims.objects[last_occluder] != ignore)
+	{
+		context->occluder_cache_tests++;
+		if (prims.occluded(last_occluder, ray, tmax))
+		{
+			context->occluder_cache_hits++;
+			return true;
 		}
 	}
 
+	uint32_t occluder;
+	if (!g_scene.light_buffer.empty())
+	{
+		if (!g_scene.light_buffer.occluded(prims, ray, tmax, ignore, &occluder)) return false;
+	}
+	else if (!scene_occluded(ray, tmax, ignore, &occluder))
+	{
+		return false;
+	}
+	last_occluder = occluder;
+	return true;
+}
+
+// finds the closest hit of a ray, primary rays only test the objects of their screen tile when there are tiles
+static float find_hit(const ray_t& ray, uint32_t depth, const trace_context_t* context, uint32_t* prim)
+{
+	if (depth == 0 && !g_scene.screen_tiles.empty())
+		return g_scene.screen_tiles.intersect(g_scene.prims, ray, context->screen_tile, prim);
+	return scene_intersect(ray, prim);
+}
+
+// The kernels below are specialized on the reflection depth, the shadow mode and, for shading, on whether the
+// material has a texture, so the branches on them fold away and trace_pixel() unrolls its bounce loop. The shadow
+// mode is chosen once per render, the texture once per hit
+
+// shades a hit, see trace_ray()
+template<uint32_t DEPTH, bool SHADOWS, bool TEXTURED>
+static void shade_hit(const surface_t& surface, const object_t* object, trace_context_t* context, ray_hit_t* hit)
+{
+	hit->object = surface.object;
+	hit->point = surface.point;
+	hit->normal = surface.normal;
+	const material_t& material = g_scene.materials[hit->object->material];
+
+	vec3_t light_dir = (g_scene.light.pos - hit->point).normalize();
+	bool in_shadow = false;
+	if (SHADOWS)
+	{
+		ray_t light_ray = { hit->point + hit->normal * 0.001f, light_dir };
+		float light_distance = (g_scene.light.pos - light_ray.origin).length(); // objects behind the light cast no shadow
+		// hit instances are not skipped since their parts can shadow each other
+		const object_t* ignore = surface.object == object ? object : nullptr;
+		context->rays++;
+		in_shadow = trace_shadow_ray(light_ray, light_distance, ignore, DEPTH, context);
+	}
+
 	color_t objectColor = hit->object->color;
-	image_t* texture = hit->object->material.texture.get();
-	if (texture != nullptr)
+	if (TEXTURED)
 	{
-		vec2_t tex_coords = hit->object->get_tex_coords(hit->point);
+		image_t* texture = material.texture.get();
+		vec2_t tex_coords = hit->object->get_tex_coords(surface.local_point);
 		float scale = hit->object->texture_scale;
 		pixel_t pixel = texture->get(tex_coords.x * scale, tex_coords.y * scale);
 		objectColor *= color_t::from_pixel(pixel);
@@ -157,59 +539,565 @@ bool trace_ray(const ray_t& ray, ray_hit_t* hit)
 	else
 	{
 		// diffuse shading
-		hit->color = hit->object->material.diffuse_c * fmax((hit->normal * light_dir).sum(), 0.0f) * objectColor;
+		hit->color = material.diffuse_c * fmax((hit->normal * light_dir).sum(), 0.0f) * objectColor;
 		// specular shading
 		vec3_t camera_dir = (g_scene.camera.pos - hit->point).normalize();
-		hit->color += hit->object->material.specular_c *
-			pow(fmax((hit->normal * (light_dir + camera_dir).normalize()).sum(), 0.0f), hit->object->material.specular_k);
+		hit->color += material.specular_c *
+			pow(fmax((hit->normal * (light_dir + camera_dir).normalize()).sum(), 0.0f), material.specular_k);
 	}
 
 	// ambient shading
-	hit->color += objectColor * hit->object->material.ambient;
+	hit->color += objectColor * material.ambient;
 	hit->color *= g_scene.light.color; // modulate final color by light color
+}
+
+// shades the closest hit of a ray found by find_hit() or a packet traversal
+template<uint32_t DEPTH, bool SHADOWS>
+static bool trace_ray(const ray_t& ray, float distance, uint32_t prim, trace_context_t* context, ray_hit_t* hit)
+{
+	context->rays++;
+	if (distance == INFINITY) return false; // no hits
+	const object_t* object = g_scene.prims.objects[prim];
 
+	surface_t surface;
+	object->get_surface(ray, distance, &surface);
+	if (g_scene.materials[surface.object->material].texture != nullptr) shade_hit<DEPTH, SHADOWS, true>(surface, object, context, hit);
+	else shade_hit<DEPTH, SHADOWS, false>(surface, object, context, hit);
 	return true;
 }
 
-void scene_render(image_t* output)
+typedef bool (*trace_ray_t)(const ray_t& ray, float distance, uint32_t prim, trace_context_t* context, ray_hit_t* hit);
+
+// for callers whose depth is only known at run time, like the stages of the wavefront renderer
+template<bool SHADOWS>
+static trace_ray_t trace_ray_kernel(uint32_t depth)
+{
+	static const trace_ray_t kernels[] = { trace_ray<0, SHADOWS>, trace_ray<1, SHADOWS>, trace_ray<2, SHADOWS> };
+	static_assert(sizeof(kernels) / sizeof(kernels[0]) == REFLECTIONS, "one kernel per reflection depth");
+	return kernels[depth];
+}
+
+static uint32_t scene_accel_nodes()
+{
+	switch (g_scene.accel)
+	{
+	case ACCEL_BVH: return (uint32_t)g_scene.bvh.nodes.size();
+	case ACCEL_BVH4: return (uint32_t)g_scene.bvh4.nodes.size();
+	case ACCEL_BVH8: return (uint32_t)g_scene.bvh8.nodes.size();
+	case ACCEL_QBVH4: return (uint32_t)g_scene.qbvh4.nodes.size();
+	case ACCEL_QBVH8: return (uint32_t)g_scene.qbvh8.nodes.size();
+	case ACCEL_LAZY_BVH: return g_scene.lazy_bvh.node_count;
+	case ACCEL_GRID: return (uint32_t)g_scene.grid.cell_starts.size() - 1;
+	default: return 0;
+	}
+}
+
+// follows a ray hitting at depth DEPTH and its reflections, adding their colors to color
+template<uint32_t DEPTH, bool SHADOWS>
+struct bounce_t
+{
+	static void trace(ray_t ray, float distance, uint32_t prim, float reflection, trace_context_t* context, color_t* color)
+	{
+		ray_hit_t hit;
+		if (!trace_ray<DEPTH, SHADOWS>(ray, distance, prim, context, &hit)) return; // exit if no hit
+
+		ray.origin = hit.point + hit.normal * 0.001f;
+		ray.direction = (ray.direction - 2.0f * (ray.direction * hit.normal).sum() * hit.normal).normalize();
+		*color += hit.color * reflection;
+
+		reflection *= g_scene.materials[hit.object->material].reflection;
+		if (reflection < 0.05f) return; // exit if reflection is too faded
+		bounce_t<DEPTH + 1, SHADOWS>::trace_reflection(ray, reflection, context, color);
+	}
+
+	static void trace_reflection(const ray_t& ray, float reflection, trace_context_t* context, color_t* color)
+	{
+		uint32_t prim;
+		float distance = find_hit(ray, DEPTH, context, &prim);
+		trace(ray, distance, prim, reflection, context, color);
+	}
+};
+
+// ends the recursion after the last reflection
+template<bool SHADOWS>
+struct bounce_t<REFLECTIONS, SHADOWS>
+{
+	static void trace_reflection(const ray_t&, float, trace_context_t*, color_t*) {}
+};
+
+// follows a camera ray and its reflections, the closest hit of the camera ray is already known
+template<bool SHADOWS>
+static color_t trace_pixel(const ray_t& ray, float distance, uint32_t prim, trace_context_t* context)
+{
+	color_t color = { 0.0f, 0.0f, 0.0f }; // color accumulator for current pixel
+	bounce_t<0, SHADOWS>::trace(ray, distance, prim, 1.0f, context, &color);
+	return color;
+}
+
+// scratch memory of the wavefront renderer, reused from tile to tile
+struct wavefront_scratch_t
+{
+	struct shade_entry_t { material_id_t material; uint32_t prim, ray; };
+
+	ray_queue_t rays, next_rays;
+	vector<float> distances;
+	vector<uint32_t> hit_prims;
+	vector<shade_entry_t> shade_order;
+	vector<color_t> colors;
+	vector<vec3_t> points, normals, directions; // of the shaded hits, then of the reflected rays
+	vector<float> reflections;
+};
+
+// everything one rendering thread writes to; scene_render() makes one per thread and call, renderer_t keeps them
+struct render_scratch_t
+{
+	trace_context_t context;
+	ray_packet_t packet;
+	wavefront_scratch_t wavefront;
+};
+
+// shared by the threads rendering one image
+struct render_frame_t
 {
-	const float ASPECT_RATIO = float(SCREEN_WIDTH) / SCREEN_HEIGHT;
-	struct { float x0, y0, x1, y1; } screen_coords =
-	{ -1.0f, -1.0f / ASPECT_RATIO + 0.25f, 1.0f, 1.0f / ASPECT_RATIO + 0.25f };
+	screen_t screen;
+	image_t* output;
+	tile_scheduler_t scheduler;
+	aabb_t bounds; // of the primitives, for sorting the wavefront rays
+	render_stats_t* stats;
+	mutex stats_mutex;
+};
 
-	float x_step = (screen_coords.x1 - screen_coords.x0) / SCREEN_WIDTH;
-	float y_step = (screen_coords.y1 - screen_coords.y0) / SCREEN_HEIGHT;
+// renders the tiles the scheduler hands to this thread, timing them for the thread statistics
+template<typename render_tile_t>
+static void for_each_tile(tile_scheduler_t* scheduler, trace_context_t* context, render_tile_t render_tile)
+{
+	typedef chrono::duration<double, milli> ms_t;
+	tile_scheduler_t::tile_t tile;
+	bool stolen;
+	while (scheduler->next(context->worker, &tile, &stolen))
+	{
+		auto begin = chrono::high_resolution_clock::now();
+		render_tile(tile);
+		context->stats.busy_ms += ms_t(chrono::high_resolution_clock::now() - begin).count();
+		context->stats.tiles++;
+		if (stolen) context->stats.stolen_tiles++;
+	}
+}
 
-	#pragma omp parallel for
-	for (int j = 0; j < SCREEN_HEIGHT; j++)
+// renders the image tile by tile, tracing every ray alone
+template<bool SHADOWS>
+static void render_tiles(render_frame_t* frame, render_scratch_t* scratch)
+{
+	const screen_t& screen = frame->screen;
+	image_t* output = frame->output;
+	trace_context_t* context = &scratch->context;
+	for_each_tile(&frame->scheduler, context, [&](const tile_scheduler_t::tile_t& tile)
 	{
-		for (uint32_t i = 0; i < SCREEN_WIDTH; i++) 
+		for (uint32_t j = tile.y0; j < tile.y1; j++)
 		{
-			// compute the world ray for the current pixel
-			float x = screen_coords.x0 + i * x_step;
-			float y = screen_coords.y0 + (SCREEN_HEIGHT - j - 1) * y_step;
-			vec3_t pixel_dir = { x, y - 0.5f, 1.0f };
-			pixel_dir.normalize();
-			ray_t ray = { g_scene.camera.pos, pixel_dir };
-
-			color_t color = { 0.0f, 0.0f, 0.0f }; // color accumulator for current pixel
-			float reflection = 1.0f; // reflection scale for current pixel
-			for (uint32_t depth = 0; depth < REFLECTIONS; depth++)
+			for (uint32_t i = tile.x0; i < tile.x1; i++)
 			{
+				// compute the world ray for the current pixel
+				ray_t ray = { g_scene.camera.pos, screen.pixel_dir(i, j) };
+				context->screen_tile = screen_tiles_t::tile_index(i, j);
+				uint32_t prim;
+				float distance = find_hit(ray, 0, context, &prim);
+				output->put(i, j, trace_pixel<SHADOWS>(ray, distance, prim, context).normalize().to_pixel());
+			}
+		}
+	});
+}
+
+// renders the image in blocks of packet_size pixels whose camera rays are traced together
+template<bool SHADOWS>
+static void render_packets(render_frame_t* frame, render_scratch_t* scratch)
+{
+	const screen_t& screen = frame->screen;
+	image_t* output = frame->output;
+	trace_context_t* context = &scratch->context;
+	ray_packet_t& packet = scratch->packet;
+	packet.origin = g_scene.camera.pos;
+
+	// the scheduler's tiles are the blocks
+	for_each_tile(&frame->scheduler, context, [&](const tile_scheduler_t::tile_t& block)
+	{
+		uint32_t i0 = block.x0, j0 = block.y0, i1 = block.x1, j1 = block.y1;
+		packet.size = 0;
+		for (uint32_t j = j0; j < j1; j++)
+			for (uint32_t i = i0; i < i1; i++)
+				packet.add(screen.pixel_dir(i, j));
+
+		if (packet.coherent())
+		{
+			g_scene.bvh.intersect(g_scene.prims, &packet);
+		}
+		else
+		{
+			for (uint32_t lane = 0; lane < packet.size; lane++)
+				packet.distance[lane] = scene_intersect(packet.ray(lane), &packet.prim[lane]);
+		}
+
+		uint32_t lane = 0;
+		for (uint32_t j = j0; j < j1; j++)
+			for (uint32_t i = i0; i < i1; i++, lane++)
+				output->put(i, j, trace_pixel<SHADOWS>(packet.ray(lane), packet.distance[lane], packet.prim[lane], context).normalize().to_pixel());
+	});
+}
+
+static const uint32_t WAVEFRONT_TILE_SIZE = 64; // pixels, the rays of a tile stay in the caches between stages
+
+// renders tiles of pixels one bounce at a time: all rays of a stage are intersected, then all hits are shaded and
+// spawn the rays of the next stage; the rays are sorted between stages and the hits before shading, which gives
+// the reflections back some of the coherence they lose in the per pixel loop. Results match trace_pixel()
+template<bool SHADOWS>
+static void render_wavefront(render_frame_t* frame, render_scratch_t* scratch)
+{
+	const screen_t& screen = frame->screen;
+	image_t* output = frame->output;
+	trace_context_t* context = &scratch->context;
+	const prim_set_t& prims = g_scene.prims;
+	const aabb_t& bounds = frame->bounds;
+
+	ray_queue_t& rays = scratch->wavefront.rays;
+	ray_queue_t& next_rays = scratch->wavefront.next_rays;
+	vector<float>& distances = scratch->wavefront.distances;
+	vector<uint32_t>& hit_prims = scratch->wavefront.hit_prims;
+	typedef wavefront_scratch_t::shade_entry_t shade_entry_t;
+	vector<shade_entry_t>& shade_order = scratch->wavefront.shade_order;
+	vector<color_t>& colors = scratch->wavefront.colors;
+	vector<vec3_t>& points = scratch->wavefront.points;
+	vector<vec3_t>& normals = scratch->wavefront.normals;
+	vector<vec3_t>& directions = scratch->wavefront.directions;
+	vector<float>& reflections = scratch->wavefront.reflections;
+
+	for_each_tile(&frame->scheduler, context, [&](const tile_scheduler_t::tile_t& tile)
+	{
+		uint32_t i0 = tile.x0, j0 = tile.y0;
+		uint32_t width = tile.x1 - tile.x0, height = tile.y1 - tile.y0;
+
+		// generate
+		rays.clear();
+		for (uint32_t y = 0; y < height; y++)
+			for (uint32_t x = 0; x < width; x++)
+				rays.push({ g_scene.camera.pos, screen.pixel_dir(i0 + x, j0 + y) }, 1.0f, y * width + x);
+		colors.assign(width * height, { 0.0f, 0.0f, 0.0f });
+
+		for (uint32_t depth = 0; depth < REFLECTIONS && rays.size() > 0; depth++)
+		{
+			// camera rays are generated in scanline order, which is already coherent
+			if (depth > 0) rays.sort(bounds);
+
+			// intersect
+			distances.resize(rays.size());
+			hit_prims.resize(rays.size());
+			for (uint32_t r = 0; r < rays.size(); r++)
+			{
+				context->screen_tile = screen_tiles_t::tile_index(i0 + rays.pixel[r] % width, j0 + rays.pixel[r] / width);
+				distances[r] = find_hit(rays.ray(r), depth, context, &hit_prims[r]);
+			}
+
+			// shade, grouped by material so that each texture is read while it is in the cache; instances sort by their
+			// own material, which is unused, the group objects they hit are only known once shaded
+			shade_order.clear();
+			for (uint32_t r = 0; r < rays.size(); r++)
+			{
+				if (distances[r] == INFINITY)
+				{
+					context->rays++; // the missed ray is counted like trace_ray() does
+					continue;
+				}
+				shade_order.push_back({ prims.objects[hit_prims[r]]->material, hit_prims[r], r });
+			}
+			sort(shade_order.begin(), shade_order.end(), [](const shade_entry_t& a, const shade_entry_t& b)
+			{
+				return a.material != b.material ? a.material < b.material : a.prim != b.prim ? a.prim < b.prim : a.ray < b.ray;
+			});
+
+			trace_ray_t trace = trace_ray_kernel<SHADOWS>(depth);
+			reflections.resize(shade_order.size());
+			points.resize(shade_order.size());
+			normals.resize(shade_order.size());
+			directions.resize(shade_order.size());
+			for (uint32_t k = 0; k < shade_order.size(); k++)
+			{
+				uint32_t r = shade_order[k].ray;
 				ray_hit_t hit;
-				if (!trace_ray(ray, &hit)) break; // exit if no hit
+				trace(rays.ray(r), distances[r], hit_prims[r], context, &hit);
+				colors[rays.pixel[r]] += hit.color * rays.weight[r];
+				reflections[k] = rays.weight[r] * g_scene.materials[hit.object->material].reflection;
+				points[k] = hit.point;
+				normals[k] = hit.normal;
+				directions[k] = rays.ray(r).direction;
+			}
 
-				ray.origin = hit.point + hit.normal * 0.001f;
-				ray.direction = (ray.direction - 2.0f * (ray.direction * hit.normal).sum() * hit.normal).normalize();
-				color += hit.color * reflection;
+			// spawn the reflections, 8 at a time
+			next_rays.clear();
+			for (uint32_t first = 0; first < shade_order.size(); first += 8)
+			{
+				uint32_t count = min(8u, (uint32_t)shade_order.size() - first);
+				vec3x8_t point = vec3x8_t::load(&points[first], count), normal = vec3x8_t::load(&normals[first], count);
+				vec3x8_t direction = vec3x8_t::load(&directions[first], count);
+				(point + normal * float8_t::set1(0.001f)).store(&points[first], count);
+				(direction - float8_t::set1(2.0f) * dot(direction, normal) * normal).normalize().store(&directions[first], count);
 
-				reflection *= hit.object->material.reflection;
-				if (reflection < 0.05f) break; // exit if reflection is too faded
+				for (uint32_t k = first; k < first + count; k++)
+				{
+					if (reflections[k] < 0.05f) continue; // the reflection is too faded
+					next_rays.push({ points[k], directions[k] }, reflections[k], rays.pixel[shade_order[k].ray]);
+				}
 			}
+			swap(rays, next_rays);
+		}
+
+		for (uint32_t y = 0; y < height; y++)
+			for (uint32_t x = 0; x < width; x++)
+				output->put(i0 + x, j0 + y, colors[y * width + x].normalize().to_pixel());
+	});
+}
+
+// one instance per shadow mode, chosen once per render
+template<bool SHADOWS>
+static void render(render_frame_t* frame, render_scratch_t* scratch)
+{
+	if (g_scene.wavefront) render_wavefront<SHADOWS>(frame, scratch);
+	else if (scene_uses_packets()) render_packets<SHADOWS>(frame, scratch);
+	else render_tiles<SHADOWS>(frame, scratch);
+}
+
+static uint32_t render_tile_size()
+{
+	if (g_scene.wavefront) return WAVEFRONT_TILE_SIZE;
+	if (scene_uses_packets()) return g_scene.packet_size;
+	return g_scene.tile_size;
+}
+
+// the part of a render run by each thread, whichever started it
+static void render_thread(render_frame_t* frame, render_scratch_t* scratch)
+{
+	trace_context_t& context = scratch->context;
+	context = {};
+	context.worker = frame->scheduler.join();
+	for (uint32_t depth = 0; depth < REFLECTIONS; depth++)
+		context.last_occluder[depth] = PRIM_NONE;
+	if (g_scene.shadows) render<true>(frame, scratch);
+	else render<false>(frame, scratch);
+
+	lock_guard<mutex> lock(frame->stats_mutex);
+	render_stats_t& stats = *frame->stats;
+	stats.rays += context.rays;
+	stats.occluder_cache_tests += context.occluder_cache_tests;
+	stats.occluder_cache_hits += context.occluder_cache_hits;
+	if (stats.threads.size() <= context.worker) stats.threads.resize(context.worker + 1);
+	stats.threads[context.worker] = context.stats;
+}
+
+// renders the region with the threads start_threads(&frame) runs render_thread() on, building the scene first if needed;
+// workers is the number of threads expected, each gets a range of tiles
+template<typename start_threads_t>
+static render_stats_t render_frame(image_t* output, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t workers,
+	start_threads_t start_threads)
+{
+	render_stats_t stats = {};
+	auto begin = chrono::high_resolution_clock::now();
+	if (!g_scene.built)
+	{
+		scene_build();
+		auto built = chrono::high_resolution_clock::now();
+		stats.build_ms = chrono::duration<double, milli>(built - begin).count();
+		begin = built;
+	}
+
+	render_frame_t frame;
+	frame.screen = screen_t::create();
+	frame.output = output;
+	frame.scheduler.reset(x0, y0, x1, y1, render_tile_size(), workers);
+	frame.bounds = aabb_t::empty();
+	if (g_scene.wavefront)
+	{
+		for (uint32_t prim = 0; prim < g_scene.prims.size(); prim++)
+			frame.bounds.grow(g_scene.prims.bounds[prim]);
+	}
+	frame.stats = &stats;
+	start_threads(&frame);
 
-			output->put(i, j, color.normalize().to_pixel());
+	stats.render_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - begin).count();
+	for (thread_stats_t& thread : stats.threads)
+		thread.idle_ms = max(stats.render_ms - thread.busy_ms, 0.0);
+	stats.accel_nodes = scene_accel_nodes(); // after rendering, the lazy hierarchy has grown with the rays
+	return stats;
+}
+
+static void render_openmp(render_frame_t* frame)
+{
+	#pragma omp parallel
+	{
+		render_scratch_t scratch;
+		render_thread(frame, &scratch);
+	}
+}
+
+render_stats_t scene_render(image_t* output)
+{
+	// one range of tiles per core; OpenMP may start another number of threads, the ranges of missing ones are
+	// stolen and extra threads only steal
+	return render_frame(output, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, thread::hardware_concurrency(), render_openmp);
+}
+
+renderer_t::renderer_t(const renderer_options_t& options)
+{
+	pool.start(options.threads, options.pin_threads, options.priority);
+	scratch.resize(pool.size());
+}
+
+renderer_t::~renderer_t()
+{
+	// the threads may still use their scratch until they are stopped
+	pool.stop();
+}
+
+render_stats_t renderer_t::render(const render_job_t& job)
+{
+	if (job.x0 >= job.x1 || job.y0 >= job.y1 || job.x1 > SCREEN_WIDTH || job.y1 > SCREEN_HEIGHT)
+	{
+		printf("Invalid render region [%u, %u) x [%u, %u)\n", job.x0, job.x1, job.y0, job.y1);
+		abort();
+	}
+
+	// the pool's threads join in any order, render_thread() indexes the statistics by scheduler worker
+	return render_frame(job.output, job.x0, job.y0, job.x1, job.y1, pool.size(), [this](render_frame_t* frame)
+	{
+		pool.run([this, frame](uint32_t index)
+		{
+			// allocated by the thread that uses it, so that it lands in memory close to its core
+			if (!scratch[index]) scratch[index] = make_unique<render_scratch_t>();
+			render_thread(frame, scratch[index].get());
+		});
+	});
+}
+
+void scene_benchmark(image_t* output)
+{
+	// brute force is quadratic in practice, it would dominate the run on large scenes
+	const size_t BRUTE_FORCE_MAX_OBJECTS = 1000;
+
+	// every ray goes through the measured structure, the light buffer and screen tiles would bypass it for the
+	// shadow and primary rays, and their build time would count as the structure's
+	accel_t selected = g_scene.accel;
+	bool light_buffer = g_scene.use_light_buffer, screen_tiles = g_scene.use_screen_tiles;
+	g_scene.use_light_buffer = false;
+	g_scene.use_screen_tiles = false;
+	printf("%-12s %12s %12s %12s %10s\n", "structure", "build ms", "nodes", "render ms", "Mrays/s");
+	for (int accel = 0; accel < ACCEL_COUNT; accel++)
+	{
+		if (accel == ACCEL_BRUTE_FORCE && g_scene.objects.size() > BRUTE_FORCE_MAX_OBJECTS) continue;
+
+		g_scene.accel = (accel_t)accel;
+		auto begin = chrono::high_resolution_clock::now();
+		scene_build();
+		double build_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - begin).count();
+		render_stats_t stats = scene_render(output);
+		printf("%-12s %12.2f %12u %12.2f %10.2f\n", accel_name((accel_t)accel), build_ms, stats.accel_nodes,
+			stats.render_ms, stats.rays / (stats.render_ms * 1000.0));
+		if (accel == ACCEL_BVH)
+		{
+			const bvh_build_stats_t& build = g_scene.bvh.build_stats;
+			printf("%-12s %u leaves, %u subtrees built in parallel, %u spatial splits, %zu references\n", "",
+				build.leaves, build.subtrees, build.spatial_splits, g_scene.bvh.prim_ids.size());
+		}
+		if (accel == ACCEL_LAZY_BVH)
+		{
+			const lazy_bvh_t& lazy = g_scene.lazy_bvh;
+			printf("%-12s %zu KB of node blocks, %zu KB of them allocated by the rays\n", "", lazy.node_memory() / 1024,
+				(lazy.node_memory() - lazy.built_memory) / 1024);
 		}
 	}
+
+	g_scene.accel = selected;
+	g_scene.use_light_buffer = light_buffer;
+	g_scene.use_screen_tiles = screen_tiles;
+	g_scene.built = false;
 }
 
+void scene_memory_report()
+{
+	if (!g_scene.built) scene_build();
+
+	// every layout is built here from the same binary hierarchy, whichever one is selected
+	bvh_t bvh;
+	bvh.build(g_scene.prims);
+	bvh4_t bvh4;
+	bvh4.build(bvh);
+	bvh8_t bvh8;
+	bvh8.build(bvh);
+	qbvh4_t qbvh4;
+	qbvh4.build(bvh4);
+	qbvh8_t qbvh8;
+	qbvh8.build(bvh8);
 
+	uint32_t prim_count = max(g_scene.prims.size(), 1u);
+	printf("%-12s %12s %10s %12s %12s\n", "structure", "nodes", "node size", "node bytes", "bytes/prim");
+	auto report = [&](accel_t accel, size_t nodes, size_t node_size, size_t prim_ids)
+	{
+		size_t node_bytes = nodes * node_size;
+		double bytes_per_prim = double(node_bytes + prim_ids * sizeof(uint32_t)) / prim_count;
+		printf("%-12s %12zu %10zu %12zu %12.1f\n", accel_name(accel), nodes, node_size, node_bytes, bytes_per_prim);
+	};
+	report(ACCEL_BVH, bvh.nodes.size(), sizeof(bvh_node_t), bvh.prim_ids.size());
+	report(ACCEL_BVH4, bvh4.nodes.size(), sizeof(wbvh_node_t<4>), bvh4.prim_ids.size());
+	report(ACCEL_BVH8, bvh8.nodes.size(), sizeof(wbvh_node_t<8>), bvh8.prim_ids.size());
+	report(ACCEL_QBVH4, qbvh4.nodes.size(), sizeof(qbvh_node_t<4>), qbvh4.prim_ids.size());
+	report(ACCEL_QBVH8, qbvh8.nodes.size(), sizeof(qbvh_node_t<8>), qbvh8.prim_ids.size());
+}
+
+// simulated node cache misses of the binary BVH, see cache_sim_t
+struct cache_observer_t : public bvh_observer_t
+{
+	cache_hierarchy_sim_t caches;
+	void visit(const void* address) { caches.access(address); }
+};
+
+void scene_cache_report()
+{
+	if (!g_scene.built) scene_build();
+
+	const screen_t screen = screen_t::create();
+	const uint32_t PIXEL_STEP = 2; // every other pixel in both directions keeps the single threaded run short
+
+	printf("%-12s %12s %12s %12s %12s\n", "layout", "rays", "node reads", "L1 misses", "L2 misses");
+	for (int layout = 0; layout < BVH_LAYOUT_COUNT; layout++)
+	{
+		bvh_t bvh;
+		bvh.build(g_scene.prims);
+		bvh.reorder((bvh_layout_t)layout);
+
+		// camera rays in scanline order and the shadow rays of their hits
+		cache_observer_t observer;
+		uint64_t rays = 0;
+		for (uint32_t j = 0; j < SCREEN_HEIGHT; j += PIXEL_STEP)
+		{
+			for (uint32_t i = 0; i < SCREEN_WIDTH; i += PIXEL_STEP)
+			{
+				ray_t ray = { g_scene.camera.pos, screen.pixel_dir(i, j) };
+				uint32_t prim;
+				float distance = bvh.intersect(g_scene.prims, ray, &prim, &observer);
+				rays++;
+				if (distance == INFINITY) continue;
+
+				surface_t surface;
+				g_scene.prims.objects[prim]->get_surface(ray, distance, &surface);
+				ray_t light_ray = { surface.point + surface.normal * 0.001f, (g_scene.light.pos - surface.point).normalize() };
+				float light_distance = (g_scene.light.pos - light_ray.origin).length();
+				const object_t* ignore = surface.object == g_scene.prims.objects[prim] ? surface.object : nullptr;
+				bvh.occluded(g_scene.prims, light_ray, light_distance, ignore, nullptr, &observer);
+				rays++;
+			}
+		}
+
+		const cache_hierarchy_sim_t& caches = observer.caches;
+		printf("%-12s %12llu %12.2f %12.3f %12.3f  per ray\n", bvh_layout_name((bvh_layout_t)layout), (unsigned long long)rays,
+			(double)caches.l1.accesses / rays, (double)caches.l1.misses / rays, (double)caches.l2.misses / rays);
+	}
+	cache_hierarchy_sim_t caches;
+	printf("simulated %u KB %u-way L1 and %u KB %u-way L2, %u byte lines\n", caches.l1.size() / 1024, caches.l1.ways,
+		caches.l2.size() / 1024, caches.l2.ways, cache_sim_t::LINE_SIZE);
+}
@@ -5,9 +5,12 @@
 #include "color.h"
 #include "quat.h"
 #include "image.h"
+#include "aabb.h"
+#include "thread_pool.h"
 
 #include <memory>
 #include <limits>
+#include <vector>
 
 struct material_t
 {	
@@ -15,25 +18,75 @@ struct material_t
 	std::shared_ptr<image_t> texture;
 };
 
+// index of a material registered with scene_add_material(); 16 bits keep the object records small, a uint32_t
+// here lifts the limit on the number of materials
+typedef uint16_t material_id_t;
+const material_id_t MATERIAL_NONE = std::numeric_limits<material_id_t>::max();
+
 struct ray_t
 {
 	vec3_t origin, direction;
 };
 
+struct shape_t;
+
+// surface properties at a ray hit
+struct surface_t
+{
+	const shape_t* object; // object providing normal, texture and material (the group object for instances)
+	vec3_t point, normal; // world space
+	vec3_t local_point; // hit point in the space of object, used for texture coordinates
+};
+
 struct object_t
 {
 	vec3_t position;
-	material_t material;
+	material_id_t material;
 	color_t color;
 	float texture_scale;
 
-	object_t() : color{1.0f, 1.0f, 1.0f}, texture_scale(1.0f) {}
+	object_t() : material(MATERIAL_NONE), color{1.0f, 1.0f, 1.0f}, texture_scale(1.0f) {}
 
-	virtual void init() {} // called once when object is added to scene
+	// bakes the values derived from the members above, called by scene_commit() and scene_update()
+	virtual void init() {}
+	// why the object can not be rendered, nullptr when it can
+	virtual const char* validate() const;
 	virtual float intersect(const ray_t& ray) const = 0;
+	// checks if the ray hits the object closer than tmax, does not need to find the closest hit
+	virtual bool occluded(const ray_t& ray, float tmax) const { return intersect(ray) < tmax; }
+	virtual aabb_t get_bounds() const = 0;
+	// bounds of the part of the object inside the box, used by spatial splits; empty when the object is outside
+	virtual aabb_t get_clipped_bounds(const aabb_t& box) const { return get_bounds().clip(box); }
+	// fills the surface for a hit found by intersect() at the given distance
+	virtual void get_surface(const ray_t& ray, float distance, surface_t* surface) const = 0;
+	virtual ~object_t() {}
+
+	// validates the object, aborting on invalid ones, and bakes it
+	void commit()
+	{
+		const char* error = validate();
+		if (error != nullptr)
+		{
+			printf("Invalid object: %s\n", error);
+			abort();
+		}
+		init();
+	}
+};
+
+// object with a surface of its own, described by its normal and texture coordinates at a point
+struct shape_t : public object_t
+{
 	virtual vec3_t get_normal(const vec3_t& point) const = 0;
 	virtual vec2_t get_tex_coords(const vec3_t& point) const = 0;
-	virtual ~object_t() {}
+
+	void get_surface(const ray_t& ray, float distance, surface_t* surface) const
+	{
+		surface->object = this;
+		surface->point = ray.origin + ray.direction * distance;
+		surface->normal = get_normal(surface->point);
+		surface->local_point = surface->point;
+	}
 };
 
 struct light_t
@@ -50,31 +103,192 @@ struct camera_t
 const uint32_t SCREEN_WIDTH = 1920, SCREEN_HEIGHT = 1080;
 const uint32_t REFLECTIONS = 3;
 
-struct sphere_t : public object_t
+struct sphere_t : public shape_t
 {
 	float radius;
+	float radius_sq, inv_radius; // baked by init()
 
+	void init();
+	const char* validate() const;
 	float intersect(const ray_t& ray) const;
+	bool occluded(const ray_t& ray, float tmax) const;
 	vec3_t get_normal(const vec3_t& point) const;
 	vec2_t get_tex_coords(const vec3_t& point) const;
+	aabb_t get_bounds() const;
 };
 
-struct plane_t : public object_t
+struct plane_t : public shape_t
 {
 	vec2_t bounds;
 	float angle; // rotation angle around normal
 	vec3_t normal;	
 	vec3_t tg, ctg; // tangent and cotangent, automatically computed during init
+	// quad basis baked by init(): tg and ctg rotated by angle and divided by bounds, so the plane coordinates
+	// dot(point - position, u) and dot(point - position, v) are in [-1, 1] inside the quad
+	vec3_t u, v;
 
 	void init();
+	const char* validate() const;
 	float intersect(const ray_t& ray) const;
+	bool occluded(const ray_t& ray, float tmax) const;
 	vec3_t get_normal(const vec3_t& point) const;
 	vec2_t get_tex_coords(const vec3_t& point) const;
+	aabb_t get_bounds() const;
+	aabb_t get_clipped_bounds(const aabb_t& box) const;
 };
 
+// structure used to find ray hits in the scene
+enum accel_t
+{
+	ACCEL_BRUTE_FORCE, // test every object, used to validate the other structures
+	ACCEL_BVH, // bounding volume hierarchy built with the surface area heuristic
+	ACCEL_BVH4, // BVH collapsed to 4 children per node, tested with SSE
+	ACCEL_BVH8, // BVH collapsed to 8 children per node, tested with AVX
+	ACCEL_QBVH4, // 4 wide BVH with child boxes quantized to 8 bits, one cache line per node
+	ACCEL_QBVH8, // 8 wide BVH with child boxes quantized to 8 bits
+	ACCEL_LAZY_BVH, // BVH split on demand while rendering, only the top levels are built up front
+	ACCEL_GRID, // uniform grid, cheap to build for many evenly spread objects of similar size
+	ACCEL_COUNT
+};
+
+const char* accel_name(accel_t accel);
+
+// order of the nodes of the binary BVH in memory
+enum bvh_layout_t
+{
+	BVH_LAYOUT_BUILD, // as allocated by the builder
+	BVH_LAYOUT_TREELET, // subtrees grouped in page sized treelets, sibling pairs aligned to cache lines
+	BVH_LAYOUT_COUNT
+};
+
+const char* bvh_layout_name(bvh_layout_t layout);
+
+// instruction sets of the batched intersection kernels, chosen at run time from what the CPU supports
+enum simd_level_t
+{
+	SIMD_SCALAR,
+	SIMD_SSE42, // 4 spheres per step
+	SIMD_AVX, // 8 spheres per step
+	SIMD_AVX512, // 16 spheres per step
+	SIMD_LEVEL_COUNT
+};
+
+const char* simd_level_name(simd_level_t level);
+
 void scene_set_light(const light_t& light);
 void scene_set_camera(const camera_t& camera);
+void scene_set_accel(accel_t accel);
+// traces shadow rays, enabled by default; without them every hit is lit
+void scene_set_shadows(bool enabled);
+// shadow rays test only the objects listed by a direction cube around the light, enabled by default
+void scene_set_light_buffer(bool enabled);
+// primary rays test only the objects whose bounds project onto their screen tile, enabled by default
+void scene_set_screen_tiles(bool enabled);
+void scene_set_bvh_layout(bvh_layout_t layout);
+// prefetches the nodes of deferred subtrees during binary BVH traversal
+void scene_set_prefetch(bool enabled);
+// builds the BVH with spatial splits, which may add up to max_reference_growth * object count references
+// so that large objects like planes do not make the nodes around them overlap; 0 (default) disables them
+void scene_set_spatial_splits(float max_reference_growth);
+// pixels per side of the tiles threads take from the scheduler when rays are traced one by one, 32 by default;
+// packets and the wavefront renderer use tiles of their own size
+void scene_set_tile_size(uint32_t size);
+// traces the camera rays of size x size pixel blocks (8 or 16) together through the binary BVH, in place of the
+// screen tiles; blocks whose rays point to different octants are traced one ray at a time. 0 (default) disables it
+void scene_set_ray_packets(uint32_t size);
+// renders tiles one bounce at a time, sorting the rays between bounces, instead of following each pixel's
+// reflections to the end; disabled by default, the per pixel loop is the reference
+void scene_set_wavefront(bool enabled);
+// highest instruction set the batched kernels may use, the best one the CPU supports by default
+void scene_set_simd_level(simd_level_t level);
+// instruction set of the kernels actually used, at most the one requested
+simd_level_t scene_simd_level();
 
+// adds a material to the scene's table and returns its index, aborts on invalid materials;
+// materials can only be added before scene_commit()
+material_id_t scene_add_material(const material_t& material);
+const material_t& scene_material(material_id_t id);
+// objects can only be added before scene_commit()
 void scene_add_object(std::unique_ptr<object_t> object);
+// ends scene setup: validates and bakes the objects, then builds the acceleration structures; the scene is frozen
+// afterwards, so rendering does no per ray setup. Required before scene_render(), objects are changed afterwards
+// through scene_update(). Returns the time spent building the acceleration structures, in ms
+double scene_commit();
+
+// timings and hierarchy quality reported by scene_update()
+struct scene_update_stats_t
+{
+	double refit_ms, rebuild_ms;
+	float cost_growth; // SAH cost relative to the last full build
+	uint32_t rebuilt_subtrees;
+	bool full_rebuild;
+};
+
+// call between frames after changing object positions or sizes (groups used by instances must not change);
+// refits the acceleration structures and rebuilds the parts that degraded too much
+scene_update_stats_t scene_update();
+
+// time a rendering thread spent on tiles, and the rest of the render, waiting for the others to finish
+struct thread_stats_t
+{
+	double busy_ms, idle_ms;
+	uint32_t tiles, stolen_tiles; // tiles rendered, and the part of them taken from other threads
+};
+
+struct render_stats_t
+{
+	double build_ms; // time spent rebuilding the acceleration structure after a setting changed, 0 if scene_commit() built it
+	double render_ms;
+	uint64_t rays; // camera, reflection and shadow rays
+	uint64_t occluder_cache_tests, occluder_cache_hits; // shadow rays tested against the last occluder first, and blocked by it
+	uint32_t accel_nodes; // nodes of the acceleration structure (cells for the grid)
+	std::vector<thread_stats_t> threads; // indexed by the order in which threads joined the render
+};
+
+// renders the whole screen with a team of OpenMP threads started for this call
+render_stats_t scene_render(image_t* output);
+
+// what renderer_t::render() draws: a region of the screen into output, which is SCREEN_WIDTH x SCREEN_HEIGHT;
+// pixels outside the region are left as they are, so previews can render a small part of the image
+struct render_job_t
+{
+	image_t* output;
+	uint32_t x0, y0, x1, y1; // pixels [x0, x1) x [y0, y1)
+
+	explicit render_job_t(image_t* output) : output(output), x0(0), y0(0), x1(SCREEN_WIDTH), y1(SCREEN_HEIGHT) {}
+};
+
+struct renderer_options_t
+{
+	uint32_t threads = 0; // one per core when 0
+	bool pin_threads = false; // keeps thread i on core i
+	pool_priority_t priority = POOL_PRIORITY_NORMAL;
+};
+
+struct render_scratch_t;
+
+// renders with threads started once, which keep their scratch memory (ray packet, wavefront queues) from one render
+// to the next; for callers rendering many frames or small previews, where starting threads would dominate
+struct renderer_t
+{
+	explicit renderer_t(const renderer_options_t& options = renderer_options_t());
+	~renderer_t();
+
+	uint32_t thread_count() const { return pool.size(); }
+	// same images and statistics as scene_render(), aborts on regions outside the screen
+	render_stats_t render(const render_job_t& job);
+
+private:
+	thread_pool_t pool;
+	std::vector<std::unique_ptr<render_scratch_t>> scratch; // per thread, allocated by it on first use
+};
+
+// renders the scene once with every acceleration structure and prints build time and Mrays/s for each; the light
+// buffer and screen tiles are off meanwhile, so every ray traverses the measured structure
+void scene_benchmark(image_t* output);
+
+// prints the node memory of every hierarchy layout for the current scene, in bytes per primitive
+void scene_memory_report();
 
-void scene_render(image_t* output);
+// prints simulated L1 and L2 misses of binary BVH traversal for every node layout
+void scene_cache_report();
@@ -0,0 +1,97 @@
+#include "screen_tiles.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const float SCREEN_TILES_NEAR = 0.0001f; // bounds closer to the camera plane project outside any finite range
+
+void screen_tiles_t::clear()
+{
+	tile_starts.clear();
+	candidates.clear();
+}
+
+void screen_tiles_t::build(const prim_set_t& prims, const vec3_t& camera_pos, const screen_t& screen)
+{
+	// pixel rectangle of every object, found by projecting the corners of its bounds
+	struct footprint_t { uint32_t prim, x0, y0, x1, y1; float distance; };
+	vector<footprint_t> footprints;
+	for (uint32_t prim = 0; prim < prims.size(); prim++)
+	{
+		const aabb_t& box = prims.bounds[prim];
+		vec3_t lo = box.min - camera_pos, hi = box.max - camera_pos;
+		if (hi.z <= 0.0f) continue; // behind the camera
+
+		float i0 = 0.0f, i1 = (float)(SCREEN_WIDTH - 1), j0 = 0.0f, j1 = (float)(SCREEN_HEIGHT - 1);
+		if (lo.z > SCREEN_TILES_NEAR)
+		{
+			float x_min = INFINITY, x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+			for (int corner = 0; corner < 8; corner++)
+			{
+				vec3_t d = { corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z };
+				float x = d.x / d.z, y = d.y / d.z + 0.5f;
+				x_min = minf(x_min, x); x_max = maxf(x_max, x);
+				y_min = minf(y_min, y); y_max = maxf(y_max, y);
+			}
+
+			// inverse of screen_t::pixel_dir, padded by a pixel against rounding
+			i0 = maxf(floorf((x_min - screen.x0) / screen.x_step) - 1.0f, i0);
+			i1 = minf(ceilf((x_max - screen.x0) / screen.x_step) + 1.0f, i1);
+			j0 = maxf(SCREEN_HEIGHT - 1 - ceilf((y_max - screen.y0) / screen.y_step) - 1.0f, j0);
+			j1 = minf(SCREEN_HEIGHT - 1 - floorf((y_min - screen.y0) / screen.y_step) + 1.0f, j1);
+			if (i0 > i1 || j0 > j1) continue; // outside the screen
+		}
+
+		vec3_t outside =
+		{
+			maxf(maxf(lo.x, -hi.x), 0.0f),
+			maxf(maxf(lo.y, -hi.y), 0.0f),
+			maxf(maxf(lo.z, -hi.z), 0.0f),
+		};
+		footprints.push_back({ prim, (uint32_t)i0 / TILE_SIZE, (uint32_t)j0 / TILE_SIZE, (uint32_t)i1 / TILE_SIZE, (uint32_t)j1 / TILE_SIZE, outside.length() });
+	}
+
+	// fill the tiles in two passes, like the grid
+	const uint32_t tile_count = TILES_X * TILES_Y;
+	tile_starts.assign(tile_count + 1, 0);
+	for (const auto& footprint : footprints)
+		for (uint32_t y = footprint.y0; y <= footprint.y1; y++)
+			for (uint32_t x = footprint.x0; x <= footprint.x1; x++)
+				tile_starts[y * TILES_X + x + 1]++;
+	for (uint32_t tile = 0; tile < tile_count; tile++)
+		tile_starts[tile + 1] += tile_starts[tile];
+
+	candidates.resize(tile_starts[tile_count]);
+	vector<uint32_t> tile_fill(tile_starts.begin(), tile_starts.end() - 1);
+	for (const auto& footprint : footprints)
+		for (uint32_t y = footprint.y0; y <= footprint.y1; y++)
+			for (uint32_t x = footprint.x0; x <= footprint.x1; x++)
+				candidates[tile_fill[y * TILES_X + x]++] = { footprint.prim, footprint.distance };
+
+	// nearest first, so a tile can be left as soon as the candidates are farther than the closest hit
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int tile = 0; tile < (int)tile_count; tile++)
+	{
+		sort(candidates.begin() + tile_starts[tile], candidates.begin() + tile_starts[tile + 1],
+			[](const candidate_t& a, const candidate_t& b) { return a.distance < b.distance; });
+	}
+}
+
+float screen_tiles_t::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t tile, uint32_t* prim) const
+{
+	float distance = INFINITY;
+	for (uint32_t i = tile_starts[tile]; i < tile_starts[tile + 1]; i++)
+	{
+		const candidate_t& candidate = candidates[i];
+		if (candidate.distance >= distance) break; // this and the following objects are behind the closest hit
+
+		float object_distance = prims.intersect(candidate.prim, ray);
+		if (object_distance < distance)
+		{
+			distance = object_distance;
+			*prim = candidate.prim;
+		}
+	}
+	return distance;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "accel.h"
+
+#include <vector>
+
+// image plane of the camera: pixel (i, j) looks along (x0 + i * x_step, y0 + (height - j - 1) * y_step - 0.5, 1)
+struct screen_t
+{
+	float x0, y0, x_step, y_step;
+
+	static screen_t create()
+	{
+		const float ASPECT_RATIO = float(SCREEN_WIDTH) / SCREEN_HEIGHT;
+		struct { float x0, y0, x1, y1; } coords = { -1.0f, -1.0f / ASPECT_RATIO + 0.25f, 1.0f, 1.0f / ASPECT_RATIO + 0.25f };
+		return { coords.x0, coords.y0, (coords.x1 - coords.x0) / SCREEN_WIDTH, (coords.y1 - coords.y0) / SCREEN_HEIGHT };
+	}
+
+	vec3_t pixel_dir(uint32_t i, uint32_t j) const
+	{
+		float x = x0 + i * x_step;
+		float y = y0 + (SCREEN_HEIGHT - j - 1) * y_step;
+		vec3_t dir = { x, y - 0.5f, 1.0f };
+		return dir.normalize();
+	}
+};
+
+// objects binned by the screen tiles their bounds project onto, primary rays only test the objects of their tile
+struct screen_tiles_t
+{
+	static const uint32_t TILE_SIZE = 16; // pixels
+	static const uint32_t TILES_X = (SCREEN_WIDTH + TILE_SIZE - 1) / TILE_SIZE, TILES_Y = (SCREEN_HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+
+	struct candidate_t
+	{
+		uint32_t prim;
+		float distance; // from the camera to the object bounds, candidates are sorted by it
+	};
+
+	std::vector<uint32_t> tile_starts; // tile i lists candidates[tile_starts[i]..tile_starts[i + 1]]
+	std::vector<candidate_t> candidates;
+
+	void build(const prim_set_t& prims, const vec3_t& camera_pos, const screen_t& screen);
+	void clear();
+
+	// the ray must start at the camera and go through a pixel of the tile
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t tile, uint32_t* prim) const;
+
+	bool empty() const { return tile_starts.empty(); }
+	static uint32_t tile_index(uint32_t i, uint32_t j) { return (j / TILE_SIZE) * TILES_X + i / TILE_SIZE; }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+// compiles a function for the given instruction set whatever the project targets, for kernels chosen at run time
+// from simd_detect_level(); MSVC needs no attribute for intrinsics. GCC must not fuse multiply and add (AVX-512
+// implies FMA), the kernels round like the scalar code so that every level gives the same results
+#ifdef _MSC_VER
+#define SIMD_TARGET(isa)
+#else
+#define SIMD_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#endif
+
+// code shared by kernels of several instruction sets must be inlined into each SIMD_TARGET function to be compiled
+// for its instruction set
+#ifdef _MSC_VER
+#define SIMD_INLINE __forceinline
+#else
+#define SIMD_INLINE inline __attribute__((always_inline))
+#endif
+
+// N floats processed by one instruction; the 8 wide version falls back to two SSE halves without AVX
+template<uint32_t N> struct simd_float_t;
+
+template<> struct simd_float_t<4>
+{
+	__m128 v;
+
+	static simd_float_t load(const float* p) { return { _mm_load_ps(p) }; }
+	static simd_float_t set1(float f) { return { _mm_set1_ps(f) }; }
+	void store(float* p) const { _mm_store_ps(p, v); }
+
+	// converts 4 bytes to floats, SSE2 has no single instruction widening them
+	static simd_float_t load_u8(const uint8_t* p)
+	{
+		int32_t bytes;
+		memcpy(&bytes, p, sizeof(bytes));
+		__m128i zero = _mm_setzero_si128();
+		__m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+		return { _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero)) };
+	}
+
+	friend simd_float_t operator+(simd_float_t a, simd_float_t b) { return { _mm_add_ps(a.v, b.v) }; }
+	friend simd_float_t operator-(simd_float_t a, simd_float_t b) { return { _mm_sub_ps(a.v, b.v) }; }
+	friend simd_float_t operator*(simd_float_t a, simd_float_t b) { return { _mm_mul_ps(a.v, b.v) }; }
+	friend simd_float_t operator/(simd_float_t a, simd_float_t b) { return { _mm_div_ps(a.v, b.v) }; }
+	friend simd_float_t sqrt(simd_float_t a) { return { _mm_sqrt_ps(a.v) }; }
+	// a * b + c, fused (rounded once) when the build targets FMA
+#ifdef __FMA__
+	friend simd_float_t madd(simd_float_t a, simd_float_t b, simd_float_t c) { return { _mm_fmadd_ps(a.v, b.v, c.v) }; }
+#else
+	friend simd_float_t madd(simd_float_t a, simd_float_t b, simd_float_t c) { return a * b + c; }
+#endif
+	friend simd_float_t min(simd_float_t a, simd_float_t b) { return { _mm_min_ps(a.v, b.v) }; }
+	friend simd_float_t max(simd_float_t a, simd_float_t b) { return { _mm_max_ps(a.v, b.v) }; }
+	friend uint32_t less_equal_mask(simd_float_t a, simd_float_t b) { return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+};
+
+#ifdef __AVX__
+template<> struct simd_float_t<8>
+{
+	__m256 v;
+
+	static simd_float_t load(const float* p) { return { _mm256_load_ps(p) }; }
+	static simd_float_t set1(float f) { return { _mm256_set1_ps(f) }; }
+	void store(float* p) const { _mm256_store_ps(p, v); }
+
+	static simd_float_t load_u8(const uint8_t* p)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+		__m256i ints = _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(words, zero)), _mm_unpackhi_epi16(words, zero), 1);
+		return { _mm256_cvtepi32_ps(ints) };
+	}
+
+	friend simd_float_t operator+(simd_float_t a, simd_float_t b) { return { _mm256_add_ps(a.v, b.v) }; }
+	friend simd_float_t operator-(simd_float_t a, simd_float_t b) { return { _mm256_sub_ps(a.v, b.v) }; }
+	friend simd_float_t operator*(simd_float_t a, simd_float_t b) { return { _mm256_mul_ps(a.v, b.v) }; }
+	friend simd_float_t operator/(simd_float_t a, simd_float_t b) { return { _mm256_div_ps(a.v, b.v) }; }
+	friend simd_float_t sqrt(simd_float_t a) { return { _mm256_sqrt_ps(a.v) }; }
+#ifdef __FMA__
+	friend simd_float_t madd(simd_float_t a, simd_float_t b, simd_float_t c) { return { _mm256_fmadd_ps(a.v, b.v, c.v) }; }
+#else
+	friend simd_float_t madd(simd_float_t a, simd_float_t b, simd_float_t c) { return a * b + c; }
+#endif
+	friend simd_float_t min(simd_float_t a, simd_float_t b) { return { _mm256_min_ps(a.v, b.v) }; }
+	friend simd_float_t max(simd_float_t a, simd_float_t b) { return { _mm256_max_ps(a.v, b.v) }; }
+	friend uint32_t less_equal_mask(simd_float_t a, simd_float_t b) { return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+};
+#else
+template<> struct simd_float_t<8>
+{
+	simd_float_t<4> lo, hi;
+
+	static simd_float_t load(const float* p) { return { simd_float_t<4>::load(p), simd_float_t<4>::load(p + 4) }; }
+	static simd_float_t set1(float f) { return { simd_float_t<4>::set1(f), simd_float_t<4>::set1(f) }; }
+	void store(float* p) const { lo.store(p); hi.store(p + 4); }
+	static simd_float_t load_u8(const uint8_t* p) { return { simd_float_t<4>::load_u8(p), simd_float_t<4>::load_u8(p + 4) }; }
+
+	friend simd_float_t operator+(simd_float_t a, simd_float_t b) { return { a.lo + b.lo, a.hi + b.hi }; }
+	friend simd_float_t operator-(simd_float_t a, simd_float_t b) { return { a.lo - b.lo, a.hi - b.hi }; }
+	friend simd_float_t operator*(simd_float_t a, simd_float_t b) { return { a.lo * b.lo, a.hi * b.hi }; }
+	friend simd_float_t operator/(simd_float_t a, simd_float_t b) { return { a.lo / b.lo, a.hi / b.hi }; }
+	friend simd_float_t sqrt(simd_float_t a) { return { sqrt(a.lo), sqrt(a.hi) }; }
+	friend simd_float_t madd(simd_float_t a, simd_float_t b, simd_float_t c) { return { madd(a.lo, b.lo, c.lo), madd(a.hi, b.hi, c.hi) }; }
+	friend simd_float_t min(simd_float_t a, simd_float_t b) { return { min(a.lo, b.lo), min(a.hi, b.hi) }; }
+	friend simd_float_t max(simd_float_t a, simd_float_t b) { return { max(a.lo, b.lo), max(a.hi, b.hi) }; }
+	friend uint32_t less_equal_mask(simd_float_t a, simd_float_t b) { return less_equal_mask(a.lo, b.lo) | (less_equal_mask(a.hi, b.hi) << 4); }
+};
+#endif
@@ -0,0 +1,256 @@
+#include "sphere_batch.h"
+#include "simd.h"
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// MSVC only has the AVX-512 intrinsics from VS2017 15.3
+#ifdef _MSC_VER
+#define SPHERE_BATCH_AVX512 (_MSC_VER >= 1911)
+#else
+#define SPHERE_BATCH_AVX512 1
+#endif
+
+const char* simd_level_name(simd_level_t level)
+{
+	static const char* names[SIMD_LEVEL_COUNT] = { "scalar", "sse4.2", "avx", "avx512" };
+	return level < SIMD_LEVEL_COUNT ? names[level] : "unknown";
+}
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+simd_level_t simd_detect_level()
+{
+	uint32_t regs[4];
+	cpuid(0, 0, regs);
+	uint32_t max_leaf = regs[0];
+	cpuid(1, 0, regs);
+	uint32_t features = regs[2];
+	if ((features & (1u << 20)) == 0) return SIMD_SCALAR;
+
+	// AVX state must be enabled by the OS (OSXSAVE, then XCR0 bits for the SSE and AVX registers)
+	bool avx = (features & (1u << 27)) != 0 && (features & (1u << 28)) != 0 && (xgetbv0() & 0x6) == 0x6;
+	if (!avx) return SIMD_SSE42;
+	if (max_leaf < 7) return SIMD_AVX;
+
+	// AVX-512 additionally needs the opmask and upper ZMM state
+	cpuid(7, 0, regs);
+	uint32_t extended = regs[1];
+	if ((extended & (1u << 16)) == 0 || (xgetbv0() & 0xE6) != 0xE6) return SIMD_AVX;
+	return SIMD_AVX512;
+}
+
+// all kernels follow sphere_intersect() operation for operation, so each lane gives the same distance as the
+// scalar code; missed lanes are set to INFINITY and the first lane with the batch minimum wins, like in the loop
+
+static void sphere_batch_scalar(const sphere_array_t& spheres, const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		float sphere_distance = sphere_intersect(spheres.center(ids[i]), spheres.radius_sq[ids[i]], ray);
+		if (sphere_distance < *distance)
+		{
+			*distance = sphere_distance;
+			*hit = ids[i];
+		}
+	}
+}
+
+static inline uint32_t first_lane(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long lane;
+	_BitScanForward(&lane, mask);
+	return lane;
+#else
+	return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+SIMD_TARGET("sse4.2")
+static void sphere_batch_sse42(const sphere_array_t& spheres, const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit)
+{
+	float a = (ray.direction * ray.direction).sum();
+	const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+	const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	const __m128 a4 = _mm_set1_ps(4.0f * a), a1 = _mm_set1_ps(a), sqrt_a = _mm_set1_ps(sqrtf(a));
+	const __m128 two = _mm_set1_ps(2.0f), minus_half = _mm_set1_ps(-0.5f), zero = _mm_setzero_ps(), inf = _mm_set1_ps(INFINITY);
+
+	for (uint32_t first = 0; first < count; first += 4)
+	{
+		// the last batch repeats its last sphere, the copies never win over the original lane
+		uint32_t lane_ids[4];
+		for (uint32_t lane = 0; lane < 4; lane++)
+			lane_ids[lane] = ids[first + lane < count ? first + lane : count - 1];
+		const float* x = spheres.x.data();
+		const float* y = spheres.y.data();
+		const float* z = spheres.z.data();
+		const float* r = spheres.radius_sq.data();
+		__m128 cx = _mm_setr_ps(x[lane_ids[0]], x[lane_ids[1]], x[lane_ids[2]], x[lane_ids[3]]);
+		__m128 cy = _mm_setr_ps(y[lane_ids[0]], y[lane_ids[1]], y[lane_ids[2]], y[lane_ids[3]]);
+		__m128 cz = _mm_setr_ps(z[lane_ids[0]], z[lane_ids[1]], z[lane_ids[2]], z[lane_ids[3]]);
+		__m128 radius_sq = _mm_setr_ps(r[lane_ids[0]], r[lane_ids[1]], r[lane_ids[2]], r[lane_ids[3]]);
+
+		__m128 osx = _mm_sub_ps(ox, cx), osy = _mm_sub_ps(oy, cy), osz = _mm_sub_ps(oz, cz);
+		__m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, osx), _mm_mul_ps(dy, osy)), _mm_mul_ps(dz, osz)));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(osx, osx), _mm_mul_ps(osy, osy)), _mm_mul_ps(osz, osz)), radius_sq);
+		__m128 d = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a4, c));
+		__m128 valid = _mm_cmpge_ps(d, zero);
+		if (_mm_movemask_ps(valid) == 0) continue; // most batches miss, skip the square root and division
+		__m128 t = _mm_div_ps(_mm_mul_ps(minus_half, _mm_add_ps(b, _mm_sqrt_ps(d))), a1);
+		valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+		__m128 lanes = _mm_blendv_ps(inf, _mm_mul_ps(sqrt_a, t), valid);
+
+		__m128 nearest = _mm_min_ps(lanes, _mm_shuffle_ps(lanes, lanes, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		float batch_distance = _mm_cvtss_f32(nearest);
+		if (batch_distance < *distance)
+		{
+			*distance = batch_distance;
+			*hit = lane_ids[first_lane(_mm_movemask_ps(_mm_cmpeq_ps(lanes, nearest)))];
+		}
+	}
+}
+
+SIMD_TARGET("avx")
+static void sphere_batch_avx(const sphere_array_t& spheres, const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit)
+{
+	float a = (ray.direction * ray.direction).sum();
+	const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+	const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+	const __m256 a4 = _mm256_set1_ps(4.0f * a), a1 = _mm256_set1_ps(a), sqrt_a = _mm256_set1_ps(sqrtf(a));
+	const __m256 two = _mm256_set1_ps(2.0f), minus_half = _mm256_set1_ps(-0.5f), zero = _mm256_setzero_ps(), inf = _mm256_set1_ps(INFINITY);
+
+	for (uint32_t first = 0; first < count; first += 8)
+	{
+		uint32_t lane_ids[8];
+		alignas(32) float x[8], y[8], z[8], r[8];
+		for (uint32_t lane = 0; lane < 8; lane++)
+		{
+			uint32_t id = lane_ids[lane] = ids[first + lane < count ? first + lane : count - 1];
+			x[lane] = spheres.x[id];
+			y[lane] = spheres.y[id];
+			z[lane] = spheres.z[id];
+			r[lane] = spheres.radius_sq[id];
+		}
+		__m256 cx = _mm256_load_ps(x), cy = _mm256_load_ps(y), cz = _mm256_load_ps(z), radius_sq = _mm256_load_ps(r);
+
+		__m256 osx = _mm256_sub_ps(ox, cx), osy = _mm256_sub_ps(oy, cy), osz = _mm256_sub_ps(oz, cz);
+		__m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, osx), _mm256_mul_ps(dy, osy)), _mm256_mul_ps(dz, osz)));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(osx, osx), _mm256_mul_ps(osy, osy)), _mm256_mul_ps(osz, osz)), radius_sq);
+		__m256 d = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a4, c));
+		__m256 valid = _mm256_cmp_ps(d, zero, _CMP_GE_OQ);
+		if (_mm256_movemask_ps(valid) == 0) continue;
+		__m256 t = _mm256_div_ps(_mm256_mul_ps(minus_half, _mm256_add_ps(b, _mm256_sqrt_ps(d))), a1);
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+		__m256 lanes = _mm256_blendv_ps(inf, _mm256_mul_ps(sqrt_a, t), valid);
+
+		__m256 nearest = _mm256_min_ps(lanes, _mm256_permute2f128_ps(lanes, lanes, 1));
+		nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		float batch_distance = _mm256_cvtss_f32(nearest);
+		if (batch_distance < *distance)
+		{
+			*distance = batch_distance;
+			*hit = lane_ids[first_lane(_mm256_movemask_ps(_mm256_cmp_ps(lanes, nearest, _CMP_EQ_OQ)))];
+		}
+	}
+}
+
+#if SPHERE_BATCH_AVX512
+// the AVX-512 intrinsics of GCC 12.2 and older fill unused results with _mm512_undefined_ps(), which
+// -Wmaybe-uninitialized reports once they are inlined into a function compiled for another target
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+SIMD_TARGET("avx512f")
+static void sphere_batch_avx512(const sphere_array_t& spheres, const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit)
+{
+	float a = (ray.direction * ray.direction).sum();
+	const __m512 dx = _mm512_set1_ps(ray.direction.x), dy = _mm512_set1_ps(ray.direction.y), dz = _mm512_set1_ps(ray.direction.z);
+	const __m512 ox = _mm512_set1_ps(ray.origin.x), oy = _mm512_set1_ps(ray.origin.y), oz = _mm512_set1_ps(ray.origin.z);
+	const __m512 a4 = _mm512_set1_ps(4.0f * a), a1 = _mm512_set1_ps(a), sqrt_a = _mm512_set1_ps(sqrtf(a));
+	const __m512 two = _mm512_set1_ps(2.0f), minus_half = _mm512_set1_ps(-0.5f), zero = _mm512_setzero_ps(), inf = _mm512_set1_ps(INFINITY);
+
+	for (uint32_t first = 0; first < count; first += 16)
+	{
+		uint32_t lane_ids[16];
+		alignas(64) float x[16], y[16], z[16], r[16];
+		for (uint32_t lane = 0; lane < 16; lane++)
+		{
+			uint32_t id = lane_ids[lane] = ids[first + lane < count ? first + lane : count - 1];
+			x[lane] = spheres.x[id];
+			y[lane] = spheres.y[id];
+			z[lane] = spheres.z[id];
+			r[lane] = spheres.radius_sq[id];
+		}
+		__m512 cx = _mm512_load_ps(x), cy = _mm512_load_ps(y), cz = _mm512_load_ps(z), radius_sq = _mm512_load_ps(r);
+
+		__m512 osx = _mm512_sub_ps(ox, cx), osy = _mm512_sub_ps(oy, cy), osz = _mm512_sub_ps(oz, cz);
+		__m512 b = _mm512_mul_ps(two, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, osx), _mm512_mul_ps(dy, osy)), _mm512_mul_ps(dz, osz)));
+		__m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(osx, osx), _mm512_mul_ps(osy, osy)), _mm512_mul_ps(osz, osz)), radius_sq);
+		__m512 d = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(a4, c));
+		__mmask16 valid = _mm512_cmp_ps_mask(d, zero, _CMP_GE_OQ);
+		if (valid == 0) continue;
+		__m512 t = _mm512_div_ps(_mm512_mul_ps(minus_half, _mm512_add_ps(b, _mm512_sqrt_ps(d))), a1);
+		valid &= _mm512_cmp_ps_mask(t, zero, _CMP_GT_OQ);
+		__m512 lanes = _mm512_mask_blend_ps(valid, inf, _mm512_mul_ps(sqrt_a, t));
+
+		__m512 nearest = _mm512_min_ps(lanes, _mm512_shuffle_f32x4(lanes, lanes, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm512_min_ps(nearest, _mm512_shuffle_f32x4(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		nearest = _mm512_min_ps(nearest, _mm512_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm512_min_ps(nearest, _mm512_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		float batch_distance = _mm512_cvtss_f32(nearest);
+		if (batch_distance < *distance)
+		{
+			*distance = batch_distance;
+			*hit = lane_ids[first_lane(_mm512_cmp_ps_mask(lanes, nearest, _CMP_EQ_OQ))];
+		}
+	}
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+sphere_batch_intersect_t sphere_batch_kernel(simd_level_t level, simd_level_t* selected)
+{
+	static const simd_level_t supported = simd_detect_level();
+	if (level > supported) level = supported;
+#if !SPHERE_BATCH_AVX512
+	if (level == SIMD_AVX512) level = SIMD_AVX;
+#endif
+	if (selected != nullptr) *selected = level;
+	switch (level)
+	{
+#if SPHERE_BATCH_AVX512
+	case SIMD_AVX512: return sphere_batch_avx512;
+#endif
+	case SIMD_AVX: return sphere_batch_avx;
+	case SIMD_SSE42: return sphere_batch_sse42;
+	default: return sphere_batch_scalar;
+	}
+}
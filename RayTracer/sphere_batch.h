@@ -0,0 +1,34 @@
+#pragma once
+
+#include "prims.h"
+
+// highest level supported by both the CPU and the operating system, which has to save the wider registers
+simd_level_t simd_detect_level();
+
+// tests one ray against the listed spheres and updates distance and hit when one of them is closer, like
+// prim_set_t::intersect; the ids are primitive indices, which are also the sphere array indices
+typedef void (*sphere_batch_intersect_t)(const sphere_array_t& spheres, const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit);
+
+// kernel of the highest level up to the given one that this build has; *selected receives its level when given
+sphere_batch_intersect_t sphere_batch_kernel(simd_level_t level, simd_level_t* selected = nullptr);
+
+// kernels of every level up to a maximum one; a list is tested by the widest kernel it fills, as padded lanes
+// cost as much as used ones and leaves and cells often hold only a few spheres
+struct sphere_batch_t
+{
+	sphere_batch_intersect_t kernels[SIMD_LEVEL_COUNT];
+
+	explicit sphere_batch_t(simd_level_t max_level = SIMD_AVX512) { select(max_level); }
+
+	void select(simd_level_t max_level)
+	{
+		for (int level = 0; level < SIMD_LEVEL_COUNT; level++)
+			kernels[level] = sphere_batch_kernel(level < max_level ? (simd_level_t)level : max_level);
+	}
+
+	void intersect(const sphere_array_t& spheres, const uint32_t* ids, uint32_t count, const ray_t& ray, float* distance, uint32_t* hit) const
+	{
+		simd_level_t level = count >= 16 ? SIMD_AVX512 : count >= 8 ? SIMD_AVX : count >= 4 ? SIMD_SSE42 : SIMD_SCALAR;
+		kernels[level](spheres, ids, count, ray, distance, hit);
+	}
+};
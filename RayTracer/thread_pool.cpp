@@ -0,0 +1,125 @@
+#include "thread_pool.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <system_error>
+
+using namespace std;
+
+const char* pool_priority_name(pool_priority_t priority)
+{
+	static const char* names[POOL_PRIORITY_COUNT] = { "low", "normal", "high" };
+	return priority < POOL_PRIORITY_COUNT ? names[priority] : "unknown";
+}
+
+// failures are reported and otherwise ignored, the threads still work where the system put them
+
+static void pin_current_thread(uint32_t core)
+{
+#ifdef _WIN32
+	if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (core % (8 * sizeof(DWORD_PTR)))) == 0)
+		printf("Failed to pin a render thread to core %u\n", core);
+#else
+	cpu_set_t cores;
+	CPU_ZERO(&cores);
+	CPU_SET(core, &cores);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) != 0)
+		printf("Failed to pin a render thread to core %u\n", core);
+#endif
+}
+
+static void set_current_thread_priority(pool_priority_t priority)
+{
+#ifdef _WIN32
+	int level = priority == POOL_PRIORITY_LOW ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_ABOVE_NORMAL;
+	if (!SetThreadPriority(GetCurrentThread(), level))
+		printf("Failed to set the %s priority of a render thread\n", pool_priority_name(priority));
+#else
+	// Linux applies nice values per thread
+	int nice = priority == POOL_PRIORITY_LOW ? 10 : -5;
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0)
+		printf("Failed to set the %s priority of a render thread\n", pool_priority_name(priority));
+#endif
+}
+
+void thread_pool_t::start(uint32_t count, bool pin, pool_priority_t priority)
+{
+	stop();
+	uint32_t cores = max(thread::hardware_concurrency(), 1u);
+	if (count == 0) count = cores;
+	if (count > MAX_THREADS) count = MAX_THREADS;
+	stopping = false;
+	for (uint32_t index = 0; index < count; index++)
+	{
+		try
+		{
+			threads.emplace_back(&thread_pool_t::worker, this, index, pin, priority);
+		}
+		catch (const system_error& error)
+		{
+			printf("Failed to start render thread %u of %u: %s\n", index + 1, count, error.what());
+			break;
+		}
+	}
+	if (threads.empty())
+	{
+		printf("No render thread could be started\n");
+		abort();
+	}
+}
+
+void thread_pool_t::stop()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (thread& worker : threads)
+		worker.join();
+	threads.clear();
+}
+
+void thread_pool_t::run(const function<void(uint32_t)>& task)
+{
+	unique_lock<std::mutex> lock(mutex);
+	this->task = &task;
+	busy = size();
+	generation++;
+	wake.notify_all();
+	done.wait(lock, [this] { return busy == 0; });
+	this->task = nullptr;
+}
+
+void thread_pool_t::worker(uint32_t index, bool pin, pool_priority_t priority)
+{
+	if (pin) pin_current_thread(index % max(thread::hardware_concurrency(), 1u));
+	if (priority != POOL_PRIORITY_NORMAL) set_current_thread_priority(priority);
+
+	uint64_t last_generation = 0;
+	unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		// run() waits for every thread, so none can miss a generation
+		wake.wait(lock, [&] { return stopping || generation != last_generation; });
+		if (stopping) return;
+		last_generation = generation;
+		const function<void(uint32_t)>& current = *task;
+
+		lock.unlock();
+		current(index);
+		lock.lock();
+		if (--busy == 0) done.notify_one();
+	}
+}
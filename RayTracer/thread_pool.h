@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum pool_priority_t
+{
+	POOL_PRIORITY_LOW, // leaves the cores to interactive work, for background renders
+	POOL_PRIORITY_NORMAL,
+	POOL_PRIORITY_HIGH, // may need privileges, the threads keep the normal priority when it is refused
+	POOL_PRIORITY_COUNT
+};
+
+const char* pool_priority_name(pool_priority_t priority);
+
+// threads started once and reused by every run(), so short tasks do not pay for starting a team of threads
+struct thread_pool_t
+{
+	thread_pool_t() {}
+	thread_pool_t(const thread_pool_t&) = delete;
+	thread_pool_t& operator=(const thread_pool_t&) = delete;
+	~thread_pool_t() { stop(); }
+
+	static const uint32_t MAX_THREADS = 1024;
+
+	// starts count threads, one per core when 0, at most MAX_THREADS; pinned threads stay on core index % cores.
+	// When the system refuses a thread the pool keeps the ones already started, and aborts if there are none
+	void start(uint32_t count, bool pin, pool_priority_t priority);
+	void stop();
+	uint32_t size() const { return (uint32_t)threads.size(); }
+
+	// calls task(index) on every thread of the pool and returns once all calls are done; the calling thread waits
+	void run(const std::function<void(uint32_t)>& task);
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(uint32_t)>* task = nullptr;
+	uint64_t generation = 0; // of the task, threads run each one once
+	uint32_t busy = 0; // threads still running the task
+	bool stopping = false;
+
+	void worker(uint32_t index, bool pin, pool_priority_t priority);
+};
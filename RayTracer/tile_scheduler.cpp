@@ -0,0 +1,98 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static uint64_t pack_range(uint32_t front, uint32_t back) { return front | ((uint64_t)back << 32); }
+static uint32_t range_front(uint64_t bounds) { return (uint32_t)bounds; }
+static uint32_t range_back(uint64_t bounds) { return (uint32_t)(bounds >> 32); }
+
+void tile_scheduler_t::reset(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t tile_size, uint32_t workers)
+{
+	this->x0 = x0;
+	this->y0 = y0;
+	this->x1 = x1;
+	this->y1 = y1;
+	this->tile_size = tile_size;
+	tiles_x = (x1 - x0 + tile_size - 1) / tile_size;
+	tiles_y = (y1 - y0 + tile_size - 1) / tile_size;
+	worker_count = max(workers, 1u);
+
+	// contiguous shares keep the tiles of a worker next to each other on screen until it starts stealing
+	ranges = make_unique<range_t[]>(worker_count);
+	uint32_t count = tile_count();
+	for (uint32_t worker = 0; worker < worker_count; worker++)
+	{
+		uint32_t front = (uint32_t)((uint64_t)count * worker / worker_count);
+		uint32_t back = (uint32_t)((uint64_t)count * (worker + 1) / worker_count);
+		ranges[worker].bounds.store(pack_range(front, back));
+	}
+	joined = 0;
+}
+
+tile_scheduler_t::tile_t tile_scheduler_t::tile(uint32_t index) const
+{
+	uint32_t left = x0 + (index % tiles_x) * tile_size, top = y0 + (index / tiles_x) * tile_size;
+	return { left, top, min(left + tile_size, x1), min(top + tile_size, y1) };
+}
+
+bool tile_scheduler_t::next(uint32_t worker, tile_t* tile, bool* stolen)
+{
+	if (worker < worker_count)
+	{
+		atomic<uint64_t>& own = ranges[worker].bounds;
+		uint64_t bounds = own.load();
+		while (range_front(bounds) < range_back(bounds))
+		{
+			// fails when a thief shortened the range in the meantime, bounds is reloaded then
+			if (own.compare_exchange_weak(bounds, pack_range(range_front(bounds) + 1, range_back(bounds))))
+			{
+				*tile = this->tile(range_front(bounds));
+				*stolen = false;
+				return true;
+			}
+		}
+	}
+
+	uint32_t index;
+	if (!steal(worker, &index)) return false;
+	*tile = this->tile(index);
+	*stolen = true;
+	return true;
+}
+
+bool tile_scheduler_t::steal(uint32_t worker, uint32_t* index)
+{
+	for (;;)
+	{
+		// the fullest range, so that few steals are needed
+		uint32_t victim = worker_count, most = 0;
+		uint64_t victim_bounds = 0;
+		for (uint32_t other = 0; other < worker_count; other++)
+		{
+			if (other == worker) continue;
+			uint64_t bounds = ranges[other].bounds.load();
+			uint32_t remaining = range_back(bounds) - range_front(bounds);
+			if (remaining > most)
+			{
+				most = remaining;
+				victim = other;
+				victim_bounds = bounds;
+			}
+		}
+		// tiles stolen by other workers but not yet in their ranges are rendered by them, nothing is lost
+		if (victim == worker_count) return false;
+
+		// workers with a range take the back half into it, the others a single tile
+		uint32_t front = range_front(victim_bounds), back = range_back(victim_bounds);
+		uint32_t middle = worker < worker_count ? front + (back - front) / 2 : back - 1;
+		if (!ranges[victim].bounds.compare_exchange_strong(victim_bounds, pack_range(front, middle)))
+			continue; // the victim or another thief got there first
+
+		*index = middle;
+		// only this worker refills its empty range, thieves skip empty ones, so a plain store is enough
+		if (middle + 1 < back) ranges[worker].bounds.store(pack_range(middle + 1, back));
+		return true;
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <memory>
+
+// hands out the tiles of an image to the rendering threads. The tiles, in scanline order, are split in one contiguous
+// range per worker; each worker takes tiles from the front of its own range and, once it is empty, steals the back
+// half of the fullest other range and makes it its new range. Only the owner refills a range, and only while it is
+// empty, so thieves never see it grow under them and each range is a single atomic word updated by compare-exchange
+struct tile_scheduler_t
+{
+	struct tile_t
+	{
+		uint32_t x0, y0, x1, y1; // pixels [x0, x1) x [y0, y1)
+	};
+
+	// splits the pixels [x0, x1) x [y0, y1) in tiles of tile_size pixels per side, spread over the given number of workers
+	void reset(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t tile_size, uint32_t workers);
+
+	// worker index of the calling thread, to be called once per thread; threads joining beyond the number of workers
+	// have no range of their own and only steal
+	uint32_t join() { return joined++; }
+
+	// takes the next tile of the worker, false when every range is empty; stolen tells if it came from another worker
+	bool next(uint32_t worker, tile_t* tile, bool* stolen);
+
+	uint32_t tile_count() const { return tiles_x * tiles_y; }
+
+private:
+	// front in the low 32 bits, back in the high ones; padded so that workers do not share cache lines
+	struct range_t
+	{
+		std::atomic<uint64_t> bounds;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	uint32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0, tile_size = 0;
+	uint32_t tiles_x = 0, tiles_y = 0;
+	uint32_t worker_count = 0;
+	std::unique_ptr<range_t[]> ranges;
+	std::atomic<uint32_t> joined;
+
+	tile_t tile(uint32_t index) const;
+	bool steal(uint32_t worker, uint32_t* index);
+};
@@ -15,6 +15,7 @@ struct vec3_t
 	vec3_t& operator*=(float rhs) { x *= rhs; y *= rhs; z *= rhs; return *this; }
 
 	vec3_t operator-() const { return { -x, -y, -z };  }
+	float operator[](int i) const { return (&x)[i]; }
 
 	vec3_t& operator^=(const vec3_t& rhs)
 	{
@@ -41,13 +42,17 @@ inline vec3_t operator^(vec3_t lhs, const vec3_t& rhs) { lhs ^= rhs; return lhs;
 
 inline vec3_t normalize(vec3_t v) { v.normalize(); return v; }
 inline float dot(const vec3_t& lhs, const vec3_t& rhs) { return (lhs * rhs).sum(); }
-inline vec3_t rotate(const vec3_t& v, const vec3_t& axis, float angle)
+// same as below with the cosine and sine of the angle computed by the caller
+inline vec3_t rotate(const vec3_t& v, const vec3_t& axis, float cost, float sint)
 {
 	// https://en.wikipedia.org/wiki/Rodrigues%27_rotation_formula
-	float cost = cosf(angle);
-	float sint = sinf(angle);
 	vec3_t result = cost * v + sint * (v ^ axis) + (1.0f - cost) * axis * dot(axis, v);
 	return result;
 }
 
+inline vec3_t rotate(const vec3_t& v, const vec3_t& axis, float angle)
+{
+	return rotate(v, axis, cosf(angle), sinf(angle));
+}
+
 
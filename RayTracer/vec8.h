@@ -0,0 +1,96 @@
+#pragma once
+
+#include "vec.h"
+#include "color.h"
+#include "simd.h"
+
+typedef simd_float_t<8> float8_t;
+
+// 8 vectors stored per component, for kernels that process 8 rays or hits at once; the operations round like
+// their vec3_t counterparts unless the build targets FMA, which fuses the products of dot()
+struct vec3x8_t
+{
+	float8_t x, y, z;
+
+	static vec3x8_t set1(const vec3_t& v) { return { float8_t::set1(v.x), float8_t::set1(v.y), float8_t::set1(v.z) }; }
+
+	// transposes 8 vectors, the last one is repeated when there are fewer
+	static vec3x8_t load(const vec3_t* v, uint32_t count = 8)
+	{
+		alignas(32) float c[3][8];
+		for (uint32_t i = 0; i < 8; i++)
+		{
+			const vec3_t& source = v[i < count ? i : count - 1];
+			c[0][i] = source.x; c[1][i] = source.y; c[2][i] = source.z;
+		}
+		return { float8_t::load(c[0]), float8_t::load(c[1]), float8_t::load(c[2]) };
+	}
+
+	void store(vec3_t* v, uint32_t count = 8) const
+	{
+		alignas(32) float c[3][8];
+		x.store(c[0]); y.store(c[1]); z.store(c[2]);
+		for (uint32_t i = 0; i < count; i++)
+			v[i] = { c[0][i], c[1][i], c[2][i] };
+	}
+
+	vec3x8_t& operator+=(const vec3x8_t& rhs) { x = x + rhs.x; y = y + rhs.y; z = z + rhs.z; return *this; }
+	vec3x8_t& operator-=(const vec3x8_t& rhs) { x = x - rhs.x; y = y - rhs.y; z = z - rhs.z; return *this; }
+	vec3x8_t& operator*=(const vec3x8_t& rhs) { x = x * rhs.x; y = y * rhs.y; z = z * rhs.z; return *this; }
+	vec3x8_t& operator*=(float8_t rhs) { x = x * rhs; y = y * rhs; z = z * rhs; return *this; }
+
+	float8_t sum() const { return x + y + z; }
+	float8_t length() const { return sqrt(x * x + y * y + z * z); }
+	vec3x8_t& normalize() { *this *= float8_t::set1(1.0f) / length(); return *this; }
+};
+
+inline vec3x8_t operator+(vec3x8_t lhs, const vec3x8_t& rhs) { lhs += rhs; return lhs; }
+inline vec3x8_t operator-(vec3x8_t lhs, const vec3x8_t& rhs) { lhs -= rhs; return lhs; }
+inline vec3x8_t operator*(vec3x8_t lhs, const vec3x8_t& rhs) { lhs *= rhs; return lhs; }
+inline vec3x8_t operator*(vec3x8_t lhs, float8_t rhs) { lhs *= rhs; return lhs; }
+inline vec3x8_t operator*(float8_t lhs, vec3x8_t rhs) { rhs *= lhs; return rhs; }
+
+inline float8_t dot(const vec3x8_t& lhs, const vec3x8_t& rhs) { return madd(lhs.z, rhs.z, madd(lhs.y, rhs.y, lhs.x * rhs.x)); }
+
+// 8 colors stored per channel
+struct color3x8_t
+{
+	float8_t r, g, b;
+
+	static color3x8_t set1(const color_t& c) { return { float8_t::set1(c.r), float8_t::set1(c.g), float8_t::set1(c.b) }; }
+
+	static color3x8_t load(const color_t* c, uint32_t count = 8)
+	{
+		alignas(32) float channels[3][8];
+		for (uint32_t i = 0; i < 8; i++)
+		{
+			const color_t& source = c[i < count ? i : count - 1];
+			channels[0][i] = source.r; channels[1][i] = source.g; channels[2][i] = source.b;
+		}
+		return { float8_t::load(channels[0]), float8_t::load(channels[1]), float8_t::load(channels[2]) };
+	}
+
+	void store(color_t* c, uint32_t count = 8) const
+	{
+		alignas(32) float channels[3][8];
+		r.store(channels[0]); g.store(channels[1]); b.store(channels[2]);
+		for (uint32_t i = 0; i < count; i++)
+			c[i] = { channels[0][i], channels[1][i], channels[2][i] };
+	}
+
+	color3x8_t& normalize()
+	{
+		float8_t zero = float8_t::set1(0.0f), one = float8_t::set1(1.0f);
+		r = max(min(r, one), zero); g = max(min(g, one), zero); b = max(min(b, one), zero);
+		return *this;
+	}
+
+	color3x8_t& operator+=(const color3x8_t& rhs) { r = r + rhs.r; g = g + rhs.g; b = b + rhs.b; return *this; }
+	color3x8_t& operator*=(const color3x8_t& rhs) { r = r * rhs.r; g = g * rhs.g; b = b * rhs.b; return *this; }
+	color3x8_t& operator*=(float8_t rhs) { r = r * rhs; g = g * rhs; b = b * rhs; return *this; }
+};
+
+inline color3x8_t operator+(color3x8_t lhs, const color3x8_t& rhs) { lhs += rhs; return lhs; }
+inline color3x8_t operator*(color3x8_t lhs, const color3x8_t& rhs) { lhs *= rhs; return lhs; }
+inline color3x8_t operator*(color3x8_t lhs, float8_t rhs) { lhs *= rhs; return lhs; }
+inline color3x8_t operator*(float8_t lhs, color3x8_t rhs) { rhs *= lhs; return rhs; }
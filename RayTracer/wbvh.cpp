@@ -0,0 +1,205 @@
+#include "wbvh.h"
+#include "simd.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// ray broadcast into SIMD registers; the near and far planes of each axis are picked once from the ray direction signs
+template<uint32_t N>
+struct wbvh_ray_t
+{
+	simd_float_t<N> origin[3], inv_dir[3];
+	uint32_t near_offset[3], far_offset[3]; // offsets of the near and far plane arrays from wbvh_node_t::min_x
+
+	explicit wbvh_ray_t(const ray_t& ray)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float inv_dir_axis = 1.0f / ray.direction[axis];
+			origin[axis] = simd_float_t<N>::set1(ray.origin[axis]);
+			inv_dir[axis] = simd_float_t<N>::set1(inv_dir_axis);
+			near_offset[axis] = (inv_dir_axis >= 0.0f ? axis : axis + 3) * N;
+			far_offset[axis] = (inv_dir_axis >= 0.0f ? axis + 3 : axis) * N;
+		}
+	}
+
+	// slab test against all children, returns the mask of the ones entered before tmax
+	uint32_t hit(const wbvh_node_t<N>& node, float tmax, float* entries) const
+	{
+		typedef simd_float_t<N> simd_t;
+		const float* planes = node.min_x;
+		simd_t tnear = simd_t::set1(0.0f), tfar = simd_t::set1(tmax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			tnear = max(tnear, (simd_t::load(planes + near_offset[axis]) - origin[axis]) * inv_dir[axis]);
+			tfar = min(tfar, (simd_t::load(planes + far_offset[axis]) - origin[axis]) * inv_dir[axis]);
+		}
+		tnear.store(entries);
+		return less_equal_mask(tnear, tfar);
+	}
+};
+
+template<uint32_t N>
+static uint32_t collapse_node(wbvh_t<N>& wbvh, const bvh_t& bvh, uint32_t bvh_node)
+{
+	// gather up to N binary nodes by repeatedly opening the interior child with the largest surface area
+	uint32_t children[N];
+	uint32_t child_count = 0;
+	children[child_count++] = bvh.nodes[bvh_node].first;
+	children[child_count++] = bvh.nodes[bvh_node].first + 1;
+	while (child_count < N)
+	{
+		int largest = -1;
+		float largest_area = -1.0f;
+		for (uint32_t i = 0; i < child_count; i++)
+		{
+			const bvh_node_t& child = bvh.nodes[children[i]];
+			if (!child.is_leaf() && child.bounds.area() > largest_area)
+			{
+				largest = (int)i;
+				largest_area = child.bounds.area();
+			}
+		}
+		if (largest < 0) break;
+
+		uint32_t opened = children[largest];
+		children[largest] = bvh.nodes[opened].first;
+		children[child_count++] = bvh.nodes[opened].first + 1;
+	}
+
+	uint32_t node_id = (uint32_t)wbvh.nodes.size();
+	wbvh.nodes.emplace_back();
+	for (uint32_t i = 0; i < N; i++)
+	{
+		// empty slots get inverted infinite boxes so the slab test always misses them
+		wbvh_node_t<N>& node = wbvh.nodes[node_id];
+		node.min_x[i] = node.min_y[i] = node.min_z[i] = INFINITY;
+		node.max_x[i] = node.max_y[i] = node.max_z[i] = -INFINITY;
+		node.child[i] = WBVH_EMPTY;
+		node.count[i] = 0;
+	}
+
+	for (uint32_t i = 0; i < child_count; i++)
+	{
+		const bvh_node_t& child = bvh.nodes[children[i]];
+		uint32_t child_id = child.is_leaf() ? child.first : collapse_node(wbvh, bvh, children[i]);
+
+		wbvh_node_t<N>& node = wbvh.nodes[node_id]; // collapse_node() may have reallocated the nodes
+		node.min_x[i] = child.bounds.min.x; node.min_y[i] = child.bounds.min.y; node.min_z[i] = child.bounds.min.z;
+		node.max_x[i] = child.bounds.max.x; node.max_y[i] = child.bounds.max.y; node.max_z[i] = child.bounds.max.z;
+		node.child[i] = child_id;
+		node.count[i] = child.count;
+	}
+
+	return node_id;
+}
+
+template<uint32_t N>
+void wbvh_t<N>::build(const bvh_t& bvh, simd_level_t max_level)
+{
+	simd_level = N == 8 && min(max_level, simd_detect_level()) >= SIMD_AVX ? SIMD_AVX : SIMD_SSE42;
+	nodes.clear();
+	prim_ids = bvh.prim_ids;
+	if (bvh.nodes.empty()) return;
+
+	if (bvh.nodes[0].is_leaf())
+	{
+		// single leaf scene, the root holds it in its first slot
+		nodes.emplace_back();
+		wbvh_node_t<N>& root = nodes[0];
+		for (uint32_t i = 0; i < N; i++)
+		{
+			root.min_x[i] = root.min_y[i] = root.min_z[i] = INFINITY;
+			root.max_x[i] = root.max_y[i] = root.max_z[i] = -INFINITY;
+			root.child[i] = WBVH_EMPTY;
+			root.count[i] = 0;
+		}
+		const bvh_node_t& leaf = bvh.nodes[0];
+		root.min_x[0] = leaf.bounds.min.x; root.min_y[0] = leaf.bounds.min.y; root.min_z[0] = leaf.bounds.min.z;
+		root.max_x[0] = leaf.bounds.max.x; root.max_y[0] = leaf.bounds.max.y; root.max_z[0] = leaf.bounds.max.z;
+		root.child[0] = leaf.first;
+		root.count[0] = leaf.count;
+		return;
+	}
+
+	nodes.reserve(bvh.nodes.size() / 2 + 1);
+	collapse_node(*this, bvh, 0);
+}
+
+// the node test of BVH8 in one AVX register whatever the project targets, with the same operations as wbvh_ray_t
+// so that both find the same hits
+struct bvh8_ray_avx_t
+{
+	__m256 origin[3], inv_dir[3];
+	uint32_t near_offset[3], far_offset[3];
+
+	SIMD_TARGET("avx")
+	explicit bvh8_ray_avx_t(const ray_t& ray)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float inv_dir_axis = 1.0f / ray.direction[axis];
+			origin[axis] = _mm256_set1_ps(ray.origin[axis]);
+			inv_dir[axis] = _mm256_set1_ps(inv_dir_axis);
+			near_offset[axis] = (inv_dir_axis >= 0.0f ? axis : axis + 3) * 8;
+			far_offset[axis] = (inv_dir_axis >= 0.0f ? axis + 3 : axis) * 8;
+		}
+	}
+
+	SIMD_TARGET("avx")
+	uint32_t hit(const wbvh_node_t<8>& node, float tmax, float* entries) const
+	{
+		const float* planes = node.min_x;
+		__m256 tnear = _mm256_setzero_ps(), tfar = _mm256_set1_ps(tmax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			tnear = _mm256_max_ps(tnear, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(planes + near_offset[axis]), origin[axis]), inv_dir[axis]));
+			tfar = _mm256_min_ps(tfar, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(planes + far_offset[axis]), origin[axis]), inv_dir[axis]));
+		}
+		_mm256_store_ps(entries, tnear);
+		return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+	}
+};
+
+SIMD_TARGET("avx")
+static float bvh8_intersect_avx(const bvh8_t& bvh8, const prim_set_t& prims, const ray_t& ray, uint32_t* prim)
+{
+	return wbvh_intersect<8, bvh8_ray_avx_t>(bvh8, prims, ray, prim);
+}
+
+SIMD_TARGET("avx")
+static bool bvh8_occluded_avx(const bvh8_t& bvh8, const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder)
+{
+	return wbvh_occluded<8, bvh8_ray_avx_t>(bvh8, prims, ray, tmax, ignore, occluder);
+}
+
+template<uint32_t N>
+float wbvh_t<N>::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	return wbvh_intersect<N, wbvh_ray_t<N>>(*this, prims, ray, prim);
+}
+
+template<uint32_t N>
+bool wbvh_t<N>::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	return wbvh_occluded<N, wbvh_ray_t<N>>(*this, prims, ray, tmax, ignore, occluder);
+}
+
+template<>
+float wbvh_t<8>::intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const
+{
+	if (simd_level >= SIMD_AVX) return bvh8_intersect_avx(*this, prims, ray, prim);
+	return wbvh_intersect<8, wbvh_ray_t<8>>(*this, prims, ray, prim);
+}
+
+template<>
+bool wbvh_t<8>::occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder) const
+{
+	if (simd_level >= SIMD_AVX) return bvh8_occluded_avx(*this, prims, ray, tmax, ignore, occluder);
+	return wbvh_occluded<8, wbvh_ray_t<8>>(*this, prims, ray, tmax, ignore, occluder);
+}
+
+template struct wbvh_t<4>;
+template struct wbvh_t<8>;
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "bvh.h"
+
+// node of a wide BVH: the boxes of all children are stored as SoA so one SIMD slab test covers the whole node
+template<uint32_t N>
+struct alignas(64) wbvh_node_t
+{
+	float min_x[N], min_y[N], min_z[N];
+	float max_x[N], max_y[N], max_z[N];
+	uint32_t child[N]; // interior child: node index, leaf child: first entry in prim_ids, empty slot: WBVH_EMPTY
+	uint32_t count[N]; // number of primitives for leaf children, 0 for interior children
+};
+
+static const uint32_t WBVH_EMPTY = 0xFFFFFFFF;
+
+// the wide tree is never deeper than the binary one, and each visited node adds at most N - 1 stack entries
+template<uint32_t N> struct wbvh_stack_t
+{
+	static const uint32_t SIZE = 64 * (N - 1) + 1;
+	struct { uint32_t child, count; float entry; } entries[SIZE];
+};
+
+// pushes the children of the node that the ray entered, the nearest one last so that it is popped first;
+// node_t is wbvh_node_t or qbvh_node_t
+template<uint32_t N, typename node_t>
+static inline void push_nearest_last(const node_t& node, uint32_t mask, const float* entries, wbvh_stack_t<N>* stack, uint32_t* stack_size)
+{
+	// sort the children that were hit from far to near
+	uint32_t order[N];
+	uint32_t hit_count = 0;
+	for (uint32_t i = 0; i < N; i++)
+	{
+		if ((mask & (1u << i)) == 0) continue;
+		uint32_t j = hit_count++;
+		for (; j > 0 && entries[order[j - 1]] < entries[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (uint32_t i = 0; i < hit_count; i++)
+	{
+		uint32_t child = order[i];
+		stack->entries[(*stack_size)++] = { node.child[child], node.count[child], entries[child] };
+	}
+}
+
+template<uint32_t N, typename node_t>
+static inline void push_entered(const node_t& node, uint32_t mask, const float* entries, wbvh_stack_t<N>* stack, uint32_t* stack_size)
+{
+	for (uint32_t i = 0; i < N; i++)
+	{
+		if (mask & (1u << i))
+			stack->entries[(*stack_size)++] = { node.child[i], node.count[i], entries[i] };
+	}
+}
+
+// traversals shared by the wide BVHs: tree_t is wbvh_t or qbvh_t, and wray_t the node test of its nodes, which
+// takes the ray in its constructor and provides hit(node, tmax, entries) like wbvh_ray_t
+template<uint32_t N, typename wray_t, typename tree_t>
+static SIMD_INLINE float wbvh_intersect(const tree_t& tree, const prim_set_t& prims, const ray_t& ray, uint32_t* prim)
+{
+	float distance = INFINITY;
+	if (tree.nodes.empty()) return distance;
+
+	wray_t wray(ray);
+	wbvh_stack_t<N> stack;
+	uint32_t stack_size = 0;
+	stack.entries[stack_size++] = { 0, 0, 0.0f };
+
+	while (stack_size > 0)
+	{
+		auto entry = stack.entries[--stack_size];
+		if (entry.entry >= distance) continue; // a closer hit was found after this entry was pushed
+
+		if (entry.count != 0)
+		{
+			prims.intersect(&tree.prim_ids[entry.child], entry.count, ray, &distance, prim);
+			continue;
+		}
+
+		const auto& node = tree.nodes[entry.child];
+		alignas(32) float entries[N];
+		uint32_t mask = wray.hit(node, distance, entries);
+		push_nearest_last<N>(node, mask, entries, &stack, &stack_size);
+	}
+
+	return distance;
+}
+
+template<uint32_t N, typename wray_t, typename tree_t>
+static SIMD_INLINE bool wbvh_occluded(const tree_t& tree, const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder)
+{
+	if (tree.nodes.empty()) return false;
+
+	wray_t wray(ray);
+	wbvh_stack_t<N> stack;
+	uint32_t stack_size = 0;
+	stack.entries[stack_size++] = { 0, 0, 0.0f };
+
+	while (stack_size > 0)
+	{
+		auto entry = stack.entries[--stack_size];
+		if (entry.count != 0)
+		{
+			if (prims.occluded(&tree.prim_ids[entry.child], entry.count, ray, tmax, ignore, occluder))
+				return true;
+			continue;
+		}
+
+		const auto& node = tree.nodes[entry.child];
+		alignas(32) float entries[N];
+		uint32_t mask = wray.hit(node, tmax, entries);
+		push_entered<N>(node, mask, entries, &stack, &stack_size);
+	}
+
+	return false;
+}
+
+// N-ary BVH collapsed from a binary one, N is 4 (SSE) or 8 (AVX)
+template<uint32_t N>
+struct wbvh_t
+{
+	std::vector<wbvh_node_t<N>, aligned_allocator_t<wbvh_node_t<N>, 64>> nodes; // root is node 0
+	std::vector<uint32_t> prim_ids;
+	// instruction set of the traversal: BVH8 tests a node in one AVX register from SIMD_AVX, in two SSE halves below
+	simd_level_t simd_level = SIMD_SSE42;
+
+	// the traversal uses the highest level up to max_level that the CPU supports
+	void build(const bvh_t& bvh, simd_level_t max_level = SIMD_AVX512);
+
+	float intersect(const prim_set_t& prims, const ray_t& ray, uint32_t* prim) const;
+	bool occluded(const prim_set_t& prims, const ray_t& ray, float tmax, const object_t* ignore, uint32_t* occluder = nullptr) const;
+};
+
+typedef wbvh_t<4> bvh4_t;
+typedef wbvh_t<8> bvh8_t;